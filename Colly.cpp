@@ -1,8 +1,917 @@
 #include "Colly.h"
 #include <algorithm>
+#include <deque>
+#include <cmath>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// SSE/AVX versions of the overlap tests in World::Check are picked at runtime (define COLLY_NO_SIMD to use only the plain C++ version)
+#if !defined(COLLY_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define COLLY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define COLLY_TARGET(x)
+#else
+#define COLLY_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+// COLLY_COUNT_RESULTS(list) counts the bodies added to a list until the end of the scope and COLLY_COUNT_GROWTH(list)
+// the memory it allocated (both do nothing without COLLY_STATS, like COLLY_STAT)
+#ifdef COLLY_STATS
+#define COLLY_COUNT_RESULTS(list) ResultCounter resultCounter(list)
+#define COLLY_COUNT_GROWTH(list) GrowthCounter<typename std::decay<decltype(list)>::type> growthCounter(list)
+#else
+#define COLLY_COUNT_RESULTS(list)
+#define COLLY_COUNT_GROWTH(list)
+#endif
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace cl
 {
+	namespace
+	{
+		// last query each body was visited in - lets QuadTree skip bodies stored in multiple nodes in O(1).
+		// Each thread has its own list so that multiple threads can query the same tree.
+		struct VisitedSet
+		{
+			std::vector<unsigned int> Stamps;
+			unsigned int Stamp = 0;
+		};
+		thread_local VisitedSet visited;
+
+#ifdef COLLY_STATS
+		// counters of a single thread (indexed by StatCounter) - only the thread itself changes them, so they dont
+		// need atomic adds, but they are atomic so that GetStats() can read them from other threads
+		struct ThreadStats
+		{
+			std::atomic<uint64_t> Counters[(int)StatCounter::Count];
+
+			ThreadStats();
+			~ThreadStats();
+		};
+
+		// counters of all the running threads + the sum of the counters of the threads that have already finished
+		struct StatsRegistry
+		{
+			std::mutex Lock;
+			std::vector<ThreadStats*> Threads;
+			uint64_t Finished[(int)StatCounter::Count] = {};
+		};
+		StatsRegistry& statsRegistry()
+		{
+			static StatsRegistry registry;
+			return registry;
+		}
+
+		ThreadStats::ThreadStats()
+		{
+			for (std::atomic<uint64_t>& counter : Counters)
+				counter = 0;
+
+			StatsRegistry& registry = statsRegistry();
+			std::lock_guard<std::mutex> lock(registry.Lock);
+			registry.Threads.push_back(this);
+		}
+		ThreadStats::~ThreadStats()
+		{
+			StatsRegistry& registry = statsRegistry();
+			std::lock_guard<std::mutex> lock(registry.Lock);
+			for (int i = 0; i < (int)StatCounter::Count; i++)
+				registry.Finished[i] += Counters[i];
+			registry.Threads.erase(std::find(registry.Threads.begin(), registry.Threads.end(), this));
+		}
+		thread_local ThreadStats threadStats;
+
+		// counts the bodies added to a list while it exists
+		struct ResultCounter
+		{
+			const std::vector<BodyHandle>& List;
+			size_t Size;
+
+			ResultCounter(const std::vector<BodyHandle>& list) : List(list), Size(list.size()) {}
+			~ResultCounter() { COLLY_STAT(CandidatesReturned, List.size() - Size); }
+		};
+
+		// counts the memory allocated by a list while it exists
+		template<typename List>
+		struct GrowthCounter
+		{
+			const List& Items;
+			size_t Capacity;
+
+			GrowthCounter(const List& items) : Items(items), Capacity(items.capacity()) {}
+			~GrowthCounter()
+			{
+				if (Items.capacity() > Capacity)
+					COLLY_STAT(BytesAllocated, (Items.capacity() - Capacity) * sizeof(typename List::value_type));
+			}
+		};
+#endif
+
+		// profiling hooks set with SetProfileHooks()
+		ProfileHook profileBegin = nullptr, profileEnd = nullptr;
+
+		// index of the lowest set bit (value cant be 0)
+		inline int countTrailingZeros(uint64_t value)
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward64(&index, value);
+			return (int)index;
+#else
+			return __builtin_ctzll(value);
+#endif
+		}
+
+		// position of a point on a Hilbert curve that goes thru every cell of a 65536x65536 grid - cells that are
+		// close on the curve are also close in the grid (and unlike the Z-order curve it never jumps far away)
+		uint32_t hilbertIndex(uint32_t x, uint32_t y)
+		{
+			uint32_t index = 0;
+			for (uint32_t s = 1 << 15; s > 0; s >>= 1) {
+				uint32_t rx = (x & s) != 0, ry = (y & s) != 0;
+				index += s * s * ((3 * rx) ^ ry);
+
+				// rotate the quadrant so that the curve inside of it starts and ends in the right corners
+				if (ry == 0) {
+					if (rx == 1) {
+						x = 0xFFFF - x;
+						y = 0xFFFF - y;
+					}
+					std::swap(x, y);
+				}
+			}
+			return index;
+		}
+
+		// bounds of the candidates of World::Check() stored in separate arrays (padded with empty boxes to a multiple of Width)
+		// so that we can test multiple candidates at once. Bodies of type None get an empty box too.
+		struct CandidateBoxes
+		{
+			static const size_t Width = 8;
+			std::vector<float> MinX, MinY, MaxX, MaxY;
+
+			void Fill(const std::vector<Body>& bodies, const std::vector<BodyHandle>& handles)
+			{
+				const float inf = std::numeric_limits<float>::infinity();
+				size_t size = (handles.size() + Width - 1) / Width * Width;
+				MinX.resize(size);
+				MinY.resize(size);
+				MaxX.resize(size);
+				MaxY.resize(size);
+				for (size_t i = 0; i < size; i++) {
+					Box b(inf, inf, -inf, -inf);
+					if (i < handles.size() && bodies[handles[i]].Type != CollisionType::None)
+						b = Box(bodies[handles[i]].Bounds);
+
+					MinX[i] = b.MinX;
+					MinY[i] = b.MinY;
+					MaxX[i] = b.MaxX;
+					MaxY[i] = b.MaxY;
+				}
+			}
+		};
+		thread_local CandidateBoxes candidateBoxes;
+
+		// the lists World::CandidateList takes - Depth of them are being used (a deque so that adding
+		// a list for a nested Check() doesnt move the lists that are being used)
+		struct CandidatePool
+		{
+			std::deque<std::vector<BodyHandle>> Lists;
+			size_t Depth = 0;
+		};
+		thread_local CandidatePool candidatePool;
+
+		// take a free list from the pool (an empty one)
+		std::vector<BodyHandle>& acquireCandidateList()
+		{
+			if (candidatePool.Depth == candidatePool.Lists.size())
+				candidatePool.Lists.emplace_back();
+
+			std::vector<BodyHandle>& list = candidatePool.Lists[candidatePool.Depth++];
+			list.clear();
+			return list;
+		}
+
+		// bit i of the result tells if candidate first + i intersects with the mover - same as candidate.Intersects(mover).
+		// std::max(a, b) is (a < b) ? b : a which is exactly what _mm_max_ps(b, a) does (for NaNs and zeros with different
+		// signs too, same for min), so all the versions give the same answers
+		unsigned int overlapMaskScalar(const CandidateBoxes& boxes, size_t first, const Box& mover)
+		{
+			unsigned int mask = 0;
+			for (size_t i = 0; i < CandidateBoxes::Width; i++) {
+				size_t j = first + i;
+				bool hit = std::max(boxes.MinX[j], mover.MinX) < std::min(boxes.MaxX[j], mover.MaxX) &&
+					std::max(boxes.MinY[j], mover.MinY) < std::min(boxes.MaxY[j], mover.MaxY);
+				mask |= (unsigned int)hit << i;
+			}
+			return mask;
+		}
+#ifdef COLLY_X86
+		COLLY_TARGET("sse2")
+		unsigned int overlapMaskSSE2(const CandidateBoxes& boxes, size_t first, const Box& mover)
+		{
+			unsigned int mask = 0;
+			for (size_t i = 0; i < CandidateBoxes::Width; i += 4) {
+				size_t j = first + i;
+				__m128 left = _mm_max_ps(_mm_set1_ps(mover.MinX), _mm_loadu_ps(&boxes.MinX[j]));
+				__m128 right = _mm_min_ps(_mm_set1_ps(mover.MaxX), _mm_loadu_ps(&boxes.MaxX[j]));
+				__m128 top = _mm_max_ps(_mm_set1_ps(mover.MinY), _mm_loadu_ps(&boxes.MinY[j]));
+				__m128 bottom = _mm_min_ps(_mm_set1_ps(mover.MaxY), _mm_loadu_ps(&boxes.MaxY[j]));
+				__m128 hit = _mm_and_ps(_mm_cmplt_ps(left, right), _mm_cmplt_ps(top, bottom));
+				mask |= (unsigned int)_mm_movemask_ps(hit) << i;
+			}
+			return mask;
+		}
+		COLLY_TARGET("avx")
+		unsigned int overlapMaskAVX(const CandidateBoxes& boxes, size_t first, const Box& mover)
+		{
+			__m256 left = _mm256_max_ps(_mm256_set1_ps(mover.MinX), _mm256_loadu_ps(&boxes.MinX[first]));
+			__m256 right = _mm256_min_ps(_mm256_set1_ps(mover.MaxX), _mm256_loadu_ps(&boxes.MaxX[first]));
+			__m256 top = _mm256_max_ps(_mm256_set1_ps(mover.MinY), _mm256_loadu_ps(&boxes.MinY[first]));
+			__m256 bottom = _mm256_min_ps(_mm256_set1_ps(mover.MaxY), _mm256_loadu_ps(&boxes.MaxY[first]));
+			__m256 hit = _mm256_and_ps(_mm256_cmp_ps(left, right, _CMP_LT_OQ), _mm256_cmp_ps(top, bottom, _CMP_LT_OQ));
+			return (unsigned int)_mm256_movemask_ps(hit);
+		}
+#endif
+
+		// pick the fastest version the CPU supports
+		typedef unsigned int (*OverlapMaskFunc)(const CandidateBoxes&, size_t, const Box&);
+		OverlapMaskFunc pickOverlapMask()
+		{
+#ifdef COLLY_X86
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 1);
+			bool sse2 = (info[3] & (1 << 26)) != 0;
+			bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6; // OS saves the AVX registers + CPU has AVX
+#else
+			__builtin_cpu_init();
+			bool sse2 = __builtin_cpu_supports("sse2");
+			bool avx = __builtin_cpu_supports("avx");
+#endif
+			if (avx)
+				return overlapMaskAVX;
+			if (sse2)
+				return overlapMaskSSE2;
+#endif
+			return overlapMaskScalar;
+		}
+		const OverlapMaskFunc overlapMask = pickOverlapMask();
+
+		// header of the files written by World::Save() and GridWorld::Save() - it is followed by the
+		// payload (everything in it is aligned to 8 bytes) and the checksum is computed from the payload
+		struct FileHeader
+		{
+			char Magic[4];
+			uint32_t Version;
+			uint32_t Kind;
+			uint32_t Info;		// broad phase type of a World, size of a tile of a GridWorld
+			uint64_t PayloadSize;
+			uint64_t Checksum;
+		};
+		const char fileMagic[4] = { 'C', 'L', 'Y', 'F' };
+		const uint32_t fileVersion = 3;	// version 2 added the static objects to World files, version 3 the collision layers
+		const uint32_t worldFile = 1;
+		const uint32_t gridFile = 2;
+
+		// a body as it is stored in a file (without the user data)
+		struct BodyRecord
+		{
+			int32_t Id;
+			float X, Y, Width, Height;
+			int32_t Type;
+		};
+
+		// collision layers of a body as they are stored in a file
+		struct LayerRecord
+		{
+			uint32_t Category, Mask;
+		};
+
+		// FNV-1a hash of the data (8 bytes at a time)
+		uint64_t checksum(const unsigned char* data, size_t size)
+		{
+			uint64_t hash = 14695981039346656037ULL;
+			size_t i = 0;
+			for (; i + 8 <= size; i += 8) {
+				uint64_t word;
+				memcpy(&word, data + i, 8);
+				hash = (hash ^ word) * 1099511628211ULL;
+			}
+			for (; i < size; i++)
+				hash = (hash ^ data[i]) * 1099511628211ULL;
+			return hash;
+		}
+
+		// append a value or an array (number of elements + the elements) to the payload
+		template<typename T>
+		void writeValue(std::vector<unsigned char>& data, const T& value)
+		{
+			const unsigned char* bytes = (const unsigned char*)&value;
+			data.insert(data.end(), bytes, bytes + sizeof(T));
+			data.resize((data.size() + 7) & ~(size_t)7, 0);
+		}
+		template<typename T>
+		void writeArray(std::vector<unsigned char>& data, const T* values, size_t count)
+		{
+			writeValue(data, (uint64_t)count);
+			const unsigned char* bytes = (const unsigned char*)values;
+			data.insert(data.end(), bytes, bytes + count * sizeof(T));
+			data.resize((data.size() + 7) & ~(size_t)7, 0);
+		}
+
+		// reads the values written by writeValue() and writeArray() and makes sure we dont read past the end
+		struct Reader
+		{
+			const unsigned char* Data;
+			size_t Size, Offset;
+
+			template<typename T>
+			bool Read(T& value)
+			{
+				if (Size - Offset < sizeof(T))
+					return false;
+				memcpy(&value, Data + Offset, sizeof(T));
+				Offset = std::min(Size, (Offset + sizeof(T) + 7) & ~(size_t)7);
+				return true;
+			}
+
+			// get a pointer to the elements of an array stored in the payload
+			template<typename T>
+			bool View(const T*& values, size_t& count)
+			{
+				uint64_t stored;
+				if (!Read(stored) || stored > (Size - Offset) / sizeof(T))
+					return false;
+				values = (const T*)(Data + Offset);
+				count = (size_t)stored;
+				Offset = std::min(Size, (Offset + count * sizeof(T) + 7) & ~(size_t)7);
+				return true;
+			}
+
+			template<typename T>
+			bool ReadArray(std::vector<T>& values)
+			{
+				const T* ptr;
+				size_t count;
+				if (!View(ptr, count))
+					return false;
+				values.resize(count);
+				if (count > 0)
+					memcpy(values.data(), ptr, count * sizeof(T));
+				return true;
+			}
+		};
+
+		// write the header and the payload
+		bool writeFile(const std::string& filename, uint32_t kind, uint32_t info, const std::vector<unsigned char>& payload)
+		{
+			FileHeader header;
+			memcpy(header.Magic, fileMagic, 4);
+			header.Version = fileVersion;
+			header.Kind = kind;
+			header.Info = info;
+			header.PayloadSize = payload.size();
+			header.Checksum = checksum(payload.data(), payload.size());
+
+			FILE* file = fopen(filename.c_str(), "wb");
+			if (file == nullptr)
+				return false;
+
+			bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+				(payload.empty() || fwrite(payload.data(), payload.size(), 1, file) == 1);
+			return fclose(file) == 0 && ok;
+		}
+
+		// check the header (and the checksum if verify is true) of a mapped file and get its payload + the version it was saved with
+		bool readFile(const MappedFile& file, uint32_t kind, uint32_t& version, uint32_t& info, Reader& payload, bool verify = true)
+		{
+			FileHeader header;
+			if (!file.IsOpen() || file.GetSize() < sizeof(header))
+				return false;
+			memcpy(&header, file.GetData(), sizeof(header));
+
+			if (memcmp(header.Magic, fileMagic, 4) != 0 || header.Version < 1 || header.Version > fileVersion || header.Kind != kind)
+				return false;
+
+			// truncated file
+			if (header.PayloadSize != file.GetSize() - sizeof(header))
+				return false;
+
+			payload.Data = file.GetData() + sizeof(header);
+			payload.Size = (size_t)header.PayloadSize;
+			payload.Offset = 0;
+			if (verify && checksum(payload.Data, payload.Size) != header.Checksum)
+				return false;
+
+			version = header.Version;
+			info = header.Info;
+			return true;
+		}
+
+		// when does a box moving by (dx, dy) start and stop overlapping the target (as a fraction of the
+		// movement) and on which axis does it start overlapping it (0 = x, 1 = y)? Returns false if they
+		// dont overlap while moving (boxes that only touch dont overlap, same as in Rect::Intersects)
+		bool sweepBox(const Box& mover, float dx, float dy, const Box& target, float& entry, int& axis)
+		{
+			const float inf = std::numeric_limits<float>::infinity();
+			float entryX = -inf, exitX = inf, entryY = -inf, exitY = inf;
+
+			if (dx > 0) {
+				entryX = (target.MinX - mover.MaxX) / dx;
+				exitX = (target.MaxX - mover.MinX) / dx;
+			} else if (dx < 0) {
+				entryX = (target.MaxX - mover.MinX) / dx;
+				exitX = (target.MinX - mover.MaxX) / dx;
+			} else if (!(mover.MinX < target.MaxX && target.MinX < mover.MaxX))
+				return false;
+
+			if (dy > 0) {
+				entryY = (target.MinY - mover.MaxY) / dy;
+				exitY = (target.MaxY - mover.MinY) / dy;
+			} else if (dy < 0) {
+				entryY = (target.MaxY - mover.MinY) / dy;
+				exitY = (target.MinY - mover.MaxY) / dy;
+			} else if (!(mover.MinY < target.MaxY && target.MinY < mover.MaxY))
+				return false;
+
+			entry = std::max(entryX, entryY);
+			float exit = std::min(exitX, exitY);
+			axis = entryX >= entryY ? 0 : 1;
+
+			return entry < exit && entry < 1 && exit > 0;
+		}
+
+		// an object touched during a sweep
+		template<typename Key>
+		struct SweepEvent
+		{
+			float Time;
+			int Axis;
+			Key Object;
+		};
+
+		// a tile touched during a sweep (tiles are ordered row by row)
+		struct TileHit
+		{
+			int X, Y, Id;
+
+			inline bool operator==(const TileHit& o) const { return X == o.X && Y == o.Y; }
+			inline bool operator<(const TileHit& o) const { return Y < o.Y || (Y == o.Y && X < o.X); }
+		};
+
+		// one pass of a sweep - the objects that might be in the way are added one by one (in any order, the
+		// same object can be added more than once) and we remember the first solid one we would hit
+		template<typename Key>
+		struct SweepState
+		{
+			Box Mover;
+			float DX, DY;
+
+			float HitTime;	// 1 if nothing is in the way
+			int HitAxis;	// -1 if nothing is in the way
+			Key Hit;
+			Box HitBounds;
+			std::vector<SweepEvent<Key>> Events;
+
+			void Add(const Key& object, const Box& bnds, CollisionType type)
+			{
+				float entry;
+				int axis;
+				if (type == CollisionType::None || !sweepBox(Mover, DX, DY, bnds, entry, axis))
+					return;
+
+				// objects we are already inside of dont stop us (so that we can get out of them), when we hit two objects
+				// at the same time the lower one stops us so that the result doesnt depend on the order they were added in
+				if (type == CollisionType::Solid && entry >= 0 && (entry < HitTime || (entry == HitTime && object < Hit))) {
+					HitTime = entry;
+					HitAxis = axis;
+					Hit = object;
+					HitBounds = bnds;
+				}
+
+				SweepEvent<Key> e = { entry, axis, object };
+				Events.push_back(e);
+			}
+		};
+
+		// continuous collision - move the bounds to the goal in one go, stop at the first solid object in the way
+		// and slide along it. gather(state) has to Add() all the objects the moving box might touch (it can skip the
+		// ones it would touch after state.HitTime), onHit(object, axis) is called once for every object we touch
+		// (in the order we touch them)
+		template<typename Key, typename Gather, typename OnHit>
+		Point sweep(Rect bounds, Point goal, Gather gather, OnHit onHit)
+		{
+			SweepState<Key> state;
+			std::vector<Key> touched;
+
+			// every hit stops the movement along one axis, so there cant be more than two hits
+			bool moveX = true, moveY = true;
+			for (int i = 0; i < 3; i++) {
+				float dx = moveX ? goal.X - bounds.X : 0;
+				float dy = moveY ? goal.Y - bounds.Y : 0;
+				if (dx == 0 && dy == 0)
+					break;
+
+				state.Mover = Box(bounds);
+				state.DX = dx;
+				state.DY = dy;
+				state.HitTime = 1;
+				state.HitAxis = -1;
+				state.Events.clear();
+				gather(state);
+
+				// tell the user about the objects we went thru before we stopped and about the one that stopped us
+				float hitTime = state.HitTime;
+				int hitAxis = state.HitAxis;
+				std::sort(state.Events.begin(), state.Events.end(), [](const SweepEvent<Key>& a, const SweepEvent<Key>& b) {
+					return a.Time < b.Time || (a.Time == b.Time && a.Object < b.Object);
+				});
+				for (const SweepEvent<Key>& e : state.Events) {
+					bool isHit = hitAxis != -1 && e.Object == state.Hit;
+					if ((e.Time >= hitTime && !isHit) || std::find(touched.begin(), touched.end(), e.Object) != touched.end())
+						continue;
+
+					touched.push_back(e.Object);
+					onHit(e.Object, isHit ? hitAxis : e.Axis);
+				}
+
+				// nothing in the way - just go to the goal (adding dx and dy could be a bit off because of rounding)
+				if (hitAxis == -1) {
+					if (moveX)
+						bounds.X = goal.X;
+					if (moveY)
+						bounds.Y = goal.Y;
+					break;
+				}
+
+				// move right next to the object (make sure rounding errors dont push us inside of it) and keep
+				// moving only along its edge
+				const Box& mover = state.Mover;
+				const Box& wall = state.HitBounds;
+				if (hitAxis == 0) {
+					bounds.X += dx > 0 ? wall.MinX - mover.MaxX : wall.MaxX - mover.MinX;
+					while (dx > 0 ? Box(bounds).MaxX > wall.MinX : Box(bounds).MinX < wall.MaxX)
+						bounds.X = std::nextafter(bounds.X, dx > 0 ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity());
+
+					bounds.Y += dy * hitTime;
+					moveX = false;
+				} else {
+					bounds.Y += dy > 0 ? wall.MinY - mover.MaxY : wall.MaxY - mover.MinY;
+					while (dy > 0 ? Box(bounds).MaxY > wall.MinY : Box(bounds).MinY < wall.MaxY)
+						bounds.Y = std::nextafter(bounds.Y, dy > 0 ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity());
+
+					bounds.X += dx * hitTime;
+					moveY = false;
+				}
+			}
+
+			return { bounds.X, bounds.Y };
+		}
+
+		// when does a ray from (x, y) moving by (dx, dy) enter the target and on which side (0 = x, 1 = y)? Unlike sweepBox
+		// a ray that goes exactly along an edge hits the box on the right/bottom side of that edge - a ray that
+		// goes along the line between two walls mustnt see thru them
+		bool rayBox(float x, float y, float dx, float dy, const Box& target, float& entry, int& axis)
+		{
+			const float inf = std::numeric_limits<float>::infinity();
+			float entryX = -inf, exitX = inf, entryY = -inf, exitY = inf;
+
+			if (dx > 0) {
+				entryX = (target.MinX - x) / dx;
+				exitX = (target.MaxX - x) / dx;
+			} else if (dx < 0) {
+				entryX = (target.MaxX - x) / dx;
+				exitX = (target.MinX - x) / dx;
+			} else if (!(target.MinX <= x && x < target.MaxX))
+				return false;
+
+			if (dy > 0) {
+				entryY = (target.MinY - y) / dy;
+				exitY = (target.MaxY - y) / dy;
+			} else if (dy < 0) {
+				entryY = (target.MaxY - y) / dy;
+				exitY = (target.MinY - y) / dy;
+			} else if (!(target.MinY <= y && y < target.MaxY))
+				return false;
+
+			entry = std::max(entryX, entryY);
+			float exit = std::min(exitX, exitY);
+			axis = entryX >= entryY ? 0 : 1;
+
+			return entry < exit && entry < 1 && exit > 0;
+		}
+
+		// how much further than the closest hit (as a fraction of the ray) we keep looking when the distances are
+		// only estimated, so that rounding errors cant make us skip an object that is hit at the same time
+		const float RaySlack = 1e-4f;
+
+		// does the segment from -> from + (dx, dy) touch the box (touching an edge counts)? entry is the fraction of the
+		// segment at which it gets to the box (0 if it starts inside). Uses the same math as rayBox, so the segment
+		// always gets to a box before it hits anything inside of it
+		bool segmentTouches(Point from, float dx, float dy, const Box& bnds, float& entry)
+		{
+			float enter = 0, exit = 1;
+			auto slab = [&](float start, float d, float min, float max) {
+				if (d == 0)
+					return min <= start && start <= max;
+
+				float t0 = (min - start) / d, t1 = (max - start) / d;
+				if (d < 0)
+					std::swap(t0, t1);
+				enter = std::max(enter, t0);
+				exit = std::min(exit, t1);
+				return enter <= exit;
+			};
+
+			if (!slab(from.X, dx, bnds.MinX, bnds.MaxX) || !slab(from.Y, dy, bnds.MinY, bnds.MaxY))
+				return false;
+
+			entry = enter;
+			return true;
+		}
+
+		// add a value to a short sorted array
+		template<typename T>
+		inline void insertSorted(T* values, int& count, const T& value)
+		{
+			int i = count++;
+			for (; i > 0 && value < values[i - 1]; i--)
+				values[i] = values[i - 1];
+			values[i] = value;
+		}
+
+		// normal of the side of a box that a ray hit (on the given axis), (0, 0) if the ray started inside of it
+		inline Point rayNormal(bool inside, int axis, float dx, float dy)
+		{
+			if (inside)
+				return { 0, 0 };
+			if (axis == 0)
+				return { dx > 0 ? -1.0f : 1.0f, 0 };
+			return { 0, dy > 0 ? -1.0f : 1.0f };
+		}
+
+		// Amanatides-Woo grid traversal for a moving box - visit(x, y) is called for the cells of a width x height grid
+		// the box might touch while moving by (dx, dy), in the order it enters them (the cells it starts in come first).
+		// Cells the box would enter after the limit (which visit can lower) are skipped. A box with no width or height
+		// (a ray) touches the cell on the right/bottom side of a grid line it is on
+		template<typename Visit>
+		void traverseGrid(const Box& mover, float dx, float dy, int cellW, int cellH, int width, int height, const float& limit, Visit visit)
+		{
+			// everything is done with doubles so that the cell indices are exact, ranges are clamped so that huge
+			// coordinates dont overflow the indices
+			auto cell = [](double v) { return (int)std::min(std::max(v, -1073741824.0), 1073741824.0); };
+
+			// cells under the box at the start
+			int minX = cell(std::floor((double)mover.MinX / cellW)), maxX = std::max(minX, cell(std::ceil((double)mover.MaxX / cellW)) - 1);
+			int minY = cell(std::floor((double)mover.MinY / cellH)), maxY = std::max(minY, cell(std::ceil((double)mover.MaxY / cellH)) - 1);
+			for (int y = std::max(minY, 0); y <= std::min(maxY, height - 1); y++)
+				for (int x = std::max(minX, 0); x <= std::min(maxX, width - 1); x++)
+					visit(x, y);
+
+			// next column and row the leading edges enter and when they enter them - columns and rows outside of
+			// the grid are skipped
+			const double inf = std::numeric_limits<double>::infinity();
+			int nextX = dx > 0 ? std::max(maxX + 1, 0) : std::min(minX - 1, width - 1);
+			int nextY = dy > 0 ? std::max(maxY + 1, 0) : std::min(minY - 1, height - 1);
+			auto timeX = [&]() -> double {
+				if (dx == 0 || nextX < 0 || nextX >= width) return inf;
+				return dx > 0 ? ((double)nextX * cellW - mover.MaxX) / dx : ((double)(nextX + 1) * cellW - mover.MinX) / dx;
+			};
+			auto timeY = [&]() -> double {
+				if (dy == 0 || nextY < 0 || nextY >= height) return inf;
+				return dy > 0 ? ((double)nextY * cellH - mover.MaxY) / dy : ((double)(nextY + 1) * cellH - mover.MinY) / dy;
+			};
+			double tX = timeX(), tY = timeY();
+
+			while (true) {
+				double t = std::min(tX, tY);
+				if (t >= 1 || t > limit + RaySlack)
+					break;
+
+				if (tX <= tY) {
+					// new column - visit the rows the box covers right now (from the trailing edge to the last row the
+					// leading edge entered, with one extra row of slack at the trailing edge)
+					int fromY = minY, toY = maxY;
+					if (dy > 0) {
+						fromY = cell(std::floor((mover.MinY + dy * t) / cellH)) - 1;
+						toY = nextY - 1;
+					} else if (dy < 0) {
+						fromY = nextY + 1;
+						toY = cell(std::ceil((mover.MaxY + dy * t) / cellH));
+					}
+					for (int y = std::max(fromY, 0); y <= std::min(toY, height - 1); y++)
+						visit(nextX, y);
+
+					nextX += dx > 0 ? 1 : -1;
+					tX = timeX();
+				} else {
+					int fromX = minX, toX = maxX;
+					if (dx > 0) {
+						fromX = cell(std::floor((mover.MinX + dx * t) / cellW)) - 1;
+						toX = nextX - 1;
+					} else if (dx < 0) {
+						fromX = nextX + 1;
+						toX = cell(std::ceil((mover.MaxX + dx * t) / cellW));
+					}
+					for (int x = std::max(fromX, 0); x <= std::min(toX, width - 1); x++)
+						visit(x, nextY);
+
+					nextY += dy > 0 ? 1 : -1;
+					tY = timeY();
+				}
+			}
+		}
+
+		// find the first tile on the line from -> to - isTile(x, y, id) returns true (and sets id) if the tile
+		// at (x, y) is one we are looking for
+		template<typename IsTile>
+		bool raycastGrid(Point from, Point to, int cellW, int cellH, int width, int height, GridRaycastHit& hit, IsTile isTile)
+		{
+			float dx = to.X - from.X, dy = to.Y - from.Y;
+			float best = 1;
+			bool found = false;
+
+			traverseGrid(Box(from.X, from.Y, from.X, from.Y), dx, dy, cellW, cellH, width, height, best, [&](int x, int y) {
+				float entry;
+				int axis, id;
+				if (!isTile(x, y, id) || !rayBox(from.X, from.Y, dx, dy, Box(Rect(x*cellW, y*cellH, cellW, cellH)), entry, axis))
+					return;
+
+				// tiles we start in are hit right away, tiles hit at the same time are ordered row by row
+				bool inside = entry < 0;
+				entry = std::max(entry, 0.0f);
+				if (found && (entry > best || (entry == best && (y > hit.Y || (y == hit.Y && x > hit.X)))))
+					return;
+
+				found = true;
+				best = entry;
+				hit.X = x;
+				hit.Y = y;
+				hit.Id = id;
+				hit.Fraction = entry;
+				hit.Position = { from.X + dx * entry, from.Y + dy * entry };
+				hit.Normal = rayNormal(inside, axis, dx, dy);
+			});
+
+			return found;
+		}
+
+		// does a ray hit the body (of the given type and in one of the layers of mask)? Fills in everything except the handle
+		bool rayHit(Point from, float dx, float dy, const Body& bdy, CollisionType type, uint32_t mask, RaycastHit& hit)
+		{
+			float entry;
+			int axis;
+			if (bdy.Type != type || (bdy.Category & mask) == 0 || !rayBox(from.X, from.Y, dx, dy, Box(bdy.Bounds), entry, axis))
+				return false;
+
+			hit.Fraction = std::max(entry, 0.0f);
+			hit.Position = { from.X + dx * hit.Fraction, from.Y + dy * hit.Fraction };
+			hit.Normal = rayNormal(entry < 0, axis, dx, dy);
+			return true;
+		}
+
+		// finds the closest body a ray hits (bodies hit at the same time are ordered by their handle)
+		class ClosestRayHit : public BroadPhase::RayVisitor
+		{
+		public:
+			ClosestRayHit(const std::vector<Body>& bodies, Point from, Point to, CollisionType type, uint32_t mask, RaycastHit& hit) :
+				Found(false), m_bodies(bodies), m_from(from), m_dx(to.X - from.X), m_dy(to.Y - from.Y), m_type(type), m_mask(mask), m_hit(hit) {}
+
+			float Visit(BodyHandle handle) override
+			{
+				RaycastHit cur;
+				if (rayHit(m_from, m_dx, m_dy, m_bodies[handle], m_type, m_mask, cur) &&
+					(!Found || cur.Fraction < m_hit.Fraction || (cur.Fraction == m_hit.Fraction && handle < m_hit.Handle))) {
+					cur.Handle = handle;
+					m_hit = cur;
+					Found = true;
+				}
+				return GetLimit();
+			}
+
+			// we dont have to look further than the closest hit
+			inline float GetLimit() const { return Found ? m_hit.Fraction : 1; }
+
+			bool Found;
+
+		private:
+			const std::vector<Body>& m_bodies;
+			Point m_from;
+			float m_dx, m_dy;
+			CollisionType m_type;
+			uint32_t m_mask;
+			RaycastHit& m_hit;
+		};
+
+		// collects all the bodies a ray hits
+		class AllRayHits : public BroadPhase::RayVisitor
+		{
+		public:
+			AllRayHits(const std::vector<Body>& bodies, Point from, Point to, CollisionType type, uint32_t mask, std::vector<RaycastHit>& hits) :
+				m_bodies(bodies), m_from(from), m_dx(to.X - from.X), m_dy(to.Y - from.Y), m_type(type), m_mask(mask), m_hits(hits) {}
+
+			float Visit(BodyHandle handle) override
+			{
+				RaycastHit cur;
+				if (rayHit(m_from, m_dx, m_dy, m_bodies[handle], m_type, m_mask, cur)) {
+					cur.Handle = handle;
+					m_hits.push_back(cur);
+				}
+				return 1;
+			}
+
+		private:
+			const std::vector<Body>& m_bodies;
+			Point m_from;
+			float m_dx, m_dy;
+			CollisionType m_type;
+			uint32_t m_mask;
+			std::vector<RaycastHit>& m_hits;
+		};
+	}
+
+
+
+	Stats GetStats()
+	{
+		uint64_t counters[(int)StatCounter::Count] = {};
+#ifdef COLLY_STATS
+		StatsRegistry& registry = statsRegistry();
+		std::lock_guard<std::mutex> lock(registry.Lock);
+		for (int i = 0; i < (int)StatCounter::Count; i++) {
+			counters[i] = registry.Finished[i];
+			for (ThreadStats* thread : registry.Threads)
+				counters[i] += thread->Counters[i];
+		}
+#endif
+
+		Stats ret;
+		ret.NodesVisited = counters[(int)StatCounter::NodesVisited];
+		ret.CandidatesReturned = counters[(int)StatCounter::CandidatesReturned];
+		ret.IntersectionTests = counters[(int)StatCounter::IntersectionTests];
+		ret.SolidResolutions = counters[(int)StatCounter::SolidResolutions];
+		ret.CallbackInvocations = counters[(int)StatCounter::CallbackInvocations];
+		ret.BytesAllocated = counters[(int)StatCounter::BytesAllocated];
+		return ret;
+	}
+	void ResetStats()
+	{
+#ifdef COLLY_STATS
+		StatsRegistry& registry = statsRegistry();
+		std::lock_guard<std::mutex> lock(registry.Lock);
+		for (int i = 0; i < (int)StatCounter::Count; i++) {
+			registry.Finished[i] = 0;
+			for (ThreadStats* thread : registry.Threads)
+				thread->Counters[i] = 0;
+		}
+#endif
+	}
+#ifdef COLLY_STATS
+	void AddStat(StatCounter counter, uint64_t n)
+	{
+		std::atomic<uint64_t>& value = threadStats.Counters[(int)counter];
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+#else
+	void AddStat(StatCounter /*counter*/, uint64_t /*n*/) {}
+#endif
+	void SetProfileHooks(ProfileHook begin, ProfileHook end)
+	{
+		profileBegin = begin;
+		profileEnd = end;
+	}
+	ProfileScope::ProfileScope(const char* name) :
+		m_name(name)
+	{
+		if (profileBegin != nullptr)
+			profileBegin(m_name);
+	}
+	ProfileScope::~ProfileScope()
+	{
+		if (profileEnd != nullptr)
+			profileEnd(m_name);
+	}
+
+
+
 	Rect::Rect()
 	{
 		X = Y = Width = Height = 0;
@@ -14,7 +923,7 @@ namespace cl
 		Width = w;
 		Height = h;
 	}
-	bool Rect::Intersects(const Rect& o, Rect& intersection)
+	bool Rect::Intersects(const Rect& o, Rect& intersection) const
 	{
 		// following code is from: https://github.com/SFML/SFML/blob/247b03172c34f25a808bcfdc49f390d619e7d5e0/include/SFML/Graphics/Rect.inl#L109
 
@@ -32,268 +941,2606 @@ namespace cl
 		float maxY2 = std::max(o.Y, o.Y + o.Height);
 
 
-		// Compute the intersection boundaries
-		float interLeft = std::max(minX1, minX2);
-		float interTop = std::max(minY1, minY2);
-		float interRight = std::min(maxX1, maxX2);
-		float interBottom = std::min(maxY1, maxY2);
+		// Compute the intersection boundaries
+		float interLeft = std::max(minX1, minX2);
+		float interTop = std::max(minY1, minY2);
+		float interRight = std::min(maxX1, maxX2);
+		float interBottom = std::min(maxY1, maxY2);
+
+
+		// If the intersection is valid (positive non zero area), then there is an intersection
+		if (interLeft < interRight && interTop < interBottom) {
+			intersection = Rect(interLeft, interTop, interRight - interLeft, interBottom - interTop);
+			return true;
+		}
+
+		intersection = Rect(0, 0, 0, 0);
+		return false;
+	}
+
+
+
+	Box::Box()
+	{
+		MinX = MinY = MaxX = MaxY = 0;
+	}
+	Box::Box(const Rect& r)
+	{
+		// same as in Rect::Intersects - width and height can be negative
+		MinX = std::min(r.X, r.X + r.Width);
+		MaxX = std::max(r.X, r.X + r.Width);
+		MinY = std::min(r.Y, r.Y + r.Height);
+		MaxY = std::max(r.Y, r.Y + r.Height);
+	}
+	Box::Box(float minX, float minY, float maxX, float maxY)
+	{
+		MinX = minX;
+		MinY = minY;
+		MaxX = maxX;
+		MaxY = maxY;
+	}
+
+
+
+	void BroadPhase::m_addPair(std::vector<BodyPair>& pairs, BodyHandle a, BodyHandle b, CollisionType typeA, CollisionType typeB) const
+	{
+		CollisionType aType = (*m_bodies)[a].Type;
+		CollisionType bType = (*m_bodies)[b].Type;
+		if (!(*m_bodies)[a].CollidesWith((*m_bodies)[b]))
+			return;
+
+		if (typeA == typeB) {
+			if (aType != typeA || bType != typeA)
+				return;
+			if (a > b)
+				std::swap(a, b);
+		} else if (aType == typeB && bType == typeA)
+			std::swap(a, b);
+		else if (aType != typeA || bType != typeB)
+			return;
+
+		BodyPair pair;
+		pair.A = a;
+		pair.B = b;
+		pairs.push_back(pair);
+	}
+
+
+
+	QuadTree::QuadTree(const std::vector<Body>& bodies, const Rect& bnds) :
+		BroadPhase(bodies)
+	{
+		m_maxCapacity = DefaultCapacity;
+		m_maxDepth = DefaultMaxDepth;
+		Reset(bnds);
+	}
+	void QuadTree::Reset(const Rect & bnds)
+	{
+		// keep the memory around so that rebuilding the tree doesnt allocate anything
+		m_nodes.resize(1);
+		m_freeNodes.clear();
+		m_elements.clear();
+		m_freeElement = None;
+
+		m_nodes[0].Bounds = Box(bnds);
+		m_nodes[0].FirstChild = None;
+		m_nodes[0].FirstElement = None;
+		m_nodes[0].Count = 0;
+		m_nodes[0].Categories = 0;
+	}
+	int QuadTree::GetDepth() const
+	{
+		// walk the tree with a stack of (node, level) pairs
+		int depth = 0;
+		std::vector<std::pair<unsigned int, int>> stack(1, std::make_pair(0u, 1));
+		while (!stack.empty()) {
+			std::pair<unsigned int, int> cur = stack.back();
+			stack.pop_back();
+
+			depth = std::max(depth, cur.second);
+			const Node& n = m_nodes[cur.first];
+			if (n.FirstChild != None)
+				for (unsigned int i = 0; i < 4; i++)
+					stack.push_back(std::make_pair(n.FirstChild + i, cur.second + 1));
+		}
+		return depth;
+	}
+	void QuadTree::Insert(BodyHandle handle)
+	{
+		Box bnds((*m_bodies)[handle].Bounds);
+
+		// objects with no area (or NaN/infinite bounds) cant overlap anything, so they arent stored - growing
+		// the root to contain them would never end
+		if (!(bnds.MinX < bnds.MaxX && bnds.MinY < bnds.MaxY) || !std::isfinite(bnds.MinX) || !std::isfinite(bnds.MinY) ||
+			!std::isfinite(bnds.MaxX) || !std::isfinite(bnds.MaxY))
+			return;
+
+		// empty tree? just take the object's bounds
+		Node& root = m_nodes[0];
+		if (root.Count == 0 && root.FirstChild == None && (root.Bounds.MaxX <= root.Bounds.MinX || root.Bounds.MaxY <= root.Bounds.MinY))
+			root.Bounds = bnds;
+
+		m_grow(bnds);
+		m_insert(0, 0, handle, bnds);
+	}
+	void QuadTree::Remove(BodyHandle handle)
+	{
+		m_remove(0, handle, Box((*m_bodies)[handle].Bounds));
+	}
+	void QuadTree::Move(BodyHandle handle, const Rect& oldBounds)
+	{
+		m_remove(0, handle, Box(oldBounds));
+		Insert(handle);
+	}
+	void QuadTree::Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask) const
+	{
+		COLLY_COUNT_RESULTS(elements);
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+		m_query(0, bnd, mask, elements, stamps, stamp);
+	}
+	void QuadTree::FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const
+	{
+		if (typeA == CollisionType::None || typeB == CollisionType::None)
+			return;
+
+		std::vector<std::pair<BodyHandle, Box>> leaf;
+		m_findPairs(0, pairs, typeA, typeB, leaf);
+	}
+	void QuadTree::Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const
+	{
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+
+		float entry;
+		if (segmentTouches(from, dx, dy, m_nodes[0].Bounds, entry) && entry <= limit)
+			m_raycast(0, from, dx, dy, visitor, limit, stamps, stamp);
+	}
+	void QuadTree::Save(std::vector<unsigned char>& data) const
+	{
+		writeValue(data, m_maxCapacity);
+		writeValue(data, m_maxDepth);
+		writeValue(data, m_freeElement);
+		writeArray(data, m_nodes.data(), m_nodes.size());
+		writeArray(data, m_freeNodes.data(), m_freeNodes.size());
+		writeArray(data, m_elements.data(), m_elements.size());
+	}
+	bool QuadTree::Load(const unsigned char* data, size_t size)
+	{
+		Reader reader = { data, size, 0 };
+		int capacity, depth;
+		unsigned int freeElement;
+		std::vector<Node> nodes;
+		std::vector<unsigned int> freeNodes;
+		std::vector<Element> elements;
+		if (!reader.Read(capacity) || !reader.Read(depth) || !reader.Read(freeElement) ||
+			!reader.ReadArray(nodes) || !reader.ReadArray(freeNodes) || !reader.ReadArray(elements))
+			return false;
+
+		// make sure that all the indices point inside of the arrays so that a broken file cant crash us
+		if (nodes.empty() || capacity < 1 || depth < 0 || (freeElement != None && freeElement >= elements.size()))
+			return false;
+		for (unsigned int block : freeNodes)
+			if (block == 0 || block >= nodes.size() || nodes.size() - block < 4)
+				return false;
+		for (const Element& el : elements)
+			if (el.Handle >= m_bodies->size() || (el.Next != None && el.Next >= elements.size()))
+				return false;
+
+		// every element can only be in one list, so we cant walk more than elements.size() steps (this also catches loops)
+		size_t steps = 0;
+		for (const Node& n : nodes) {
+			if (n.FirstChild != None) {
+				if (n.FirstChild == 0 || n.FirstChild >= nodes.size() || nodes.size() - n.FirstChild < 4 || n.FirstElement != None)
+					return false;
+				continue;
+			}
+
+			int count = 0;
+			for (unsigned int el = n.FirstElement; el != None; el = elements[el].Next) {
+				if (el >= elements.size() || ++steps > elements.size())
+					return false;
+				count++;
+			}
+			if (count != n.Count)
+				return false;
+		}
+
+		// take the layers from the bodies - list the nodes from the root down and fill them in the reverse order so that
+		// the children are done before their parents (the tree cant have more nodes than the array, this catches loops)
+		std::vector<unsigned int> order(1, 0u);
+		for (size_t i = 0; i < order.size(); i++) {
+			if (nodes[order[i]].FirstChild != None)
+				for (unsigned int c = 0; c < 4; c++)
+					order.push_back(nodes[order[i]].FirstChild + c);
+			if (order.size() > nodes.size())
+				return false;
+		}
+		for (size_t i = order.size(); i-- > 0;) {
+			Node& n = nodes[order[i]];
+			n.Categories = 0;
+			if (n.FirstChild != None) {
+				for (unsigned int c = 0; c < 4; c++)
+					n.Categories |= nodes[n.FirstChild + c].Categories;
+			} else {
+				for (unsigned int el = n.FirstElement; el != None; el = elements[el].Next)
+					n.Categories |= (*m_bodies)[elements[el].Handle].Category;
+			}
+		}
+
+		m_maxCapacity = capacity;
+		m_maxDepth = depth;
+		m_freeElement = freeElement;
+		m_nodes.swap(nodes);
+		m_freeNodes.swap(freeNodes);
+		m_elements.swap(elements);
+		return true;
+	}
+	void QuadTree::m_insert(unsigned int node, int depth, BodyHandle handle, const Box& bnds)
+	{
+		if (!m_nodes[node].Bounds.Overlaps(bnds))
+			return;
+
+		// the object will be somewhere under this node
+		m_nodes[node].Categories |= (*m_bodies)[handle].Category;
+
+		if (m_nodes[node].FirstChild == None) {
+			// do we have enough space (or cant go any deeper)? if yes, just add it to this leaf
+			int count = m_nodes[node].Count;
+			if (count < m_maxCapacity || depth >= m_maxDepth) {
+				m_addElement(node, handle);
+				return;
+			}
+
+			// leaves that werent worth splitting are checked again only once their size doubles
+			int ratio = count / m_maxCapacity;
+			bool recheck = count % m_maxCapacity == 0 && (ratio & (ratio - 1)) == 0;
+			if (!recheck || !m_shouldSplit(node, bnds)) {
+				m_addElement(node, handle);
+				return;
+			}
+
+			m_subdivide(node, depth);
+		}
+
+		// insert into all regions that intersect with the rectangle
+		unsigned int child = m_nodes[node].FirstChild;
+		for (unsigned int i = 0; i < 4; i++)
+			m_insert(child + i, depth + 1, handle, bnds);
+	}
+	void QuadTree::m_remove(unsigned int node, BodyHandle handle, const Box& bnds)
+	{
+		Node& n = m_nodes[node];
+
+		// the object can only be in the nodes it intersects with
+		if (!n.Bounds.Overlaps(bnds))
+			return;
+
+		if (n.FirstChild == None) {
+			// unlink the element and give it back to the pool
+			unsigned int* link = &n.FirstElement;
+			while (*link != None) {
+				unsigned int el = *link;
+				if (m_elements[el].Handle == handle) {
+					*link = m_elements[el].Next;
+					m_elements[el].Next = m_freeElement;
+					m_freeElement = el;
+					n.Count--;
+					m_updateCategories(node);
+					return;
+				}
+				link = &m_elements[el].Next;
+			}
+			return;
+		}
+
+		for (unsigned int i = 0; i < 4; i++)
+			m_remove(n.FirstChild + i, handle, bnds);
+
+		m_merge(node);
+		m_updateCategories(node);
+	}
+	void QuadTree::m_raycast(unsigned int node, Point from, float dx, float dy, RayVisitor& visitor, float& limit, unsigned int* stamps, unsigned int stamp) const
+	{
+		const Node& n = m_nodes[node];
+
+		if (n.FirstChild != None) {
+			// sort the children the ray goes thru by when it gets to them
+			std::pair<float, unsigned int> order[4];
+			int count = 0;
+			for (unsigned int i = 0; i < 4; i++) {
+				float entry;
+				if (segmentTouches(from, dx, dy, m_nodes[n.FirstChild + i].Bounds, entry))
+					insertSorted(order, count, std::make_pair(entry, n.FirstChild + i));
+			}
+
+			// the ray gets to everything in a child after it gets to the child, so we can stop at the first
+			// child that is further away than the closest hit
+			for (int i = 0; i < count && order[i].first <= limit; i++)
+				m_raycast(order[i].second, from, dx, dy, visitor, limit, stamps, stamp);
+			return;
+		}
+
+		for (unsigned int el = n.FirstElement; el != None; el = m_elements[el].Next) {
+			BodyHandle handle = m_elements[el].Handle;
+			if (stamps[handle] == stamp)
+				continue;
+			stamps[handle] = stamp;
+
+			if ((*m_bodies)[handle].Type != CollisionType::None)
+				limit = visitor.Visit(handle);
+		}
+	}
+	void QuadTree::m_query(unsigned int node, const Box& bnd, uint32_t mask, std::vector<BodyHandle>& elements, unsigned int* stamps, unsigned int stamp) const
+	{
+		const Node& n = m_nodes[node];
+		COLLY_STAT(NodesVisited, 1);
+
+		// check if our bounds intersect with the quad tree node and if it has any objects in the layers we are looking for
+		if ((n.Categories & mask) == 0 || !n.Bounds.Overlaps(bnd))
+			return;
+
+		// query all the regions
+		if (n.FirstChild != None) {
+			for (unsigned int i = 0; i < 4; i++)
+				m_query(n.FirstChild + i, bnd, mask, elements, stamps, stamp);
+			return;
+		}
+
+		// get all elements in this leaf and check if they intersect with our bounds - if the leaf
+		// is completely inside of the range, every element in it must intersect with the range too
+		bool inside = bnd.Contains(n.Bounds);
+		for (unsigned int el = n.FirstElement; el != None; el = m_elements[el].Next) {
+			BodyHandle handle = m_elements[el].Handle;
+
+			// skip the objects we have already seen in some other node
+			if (stamps[handle] == stamp)
+				continue;
+			stamps[handle] = stamp;
+
+			const Body& bdy = (*m_bodies)[handle];
+			if (bdy.Type != CollisionType::None && (bdy.Category & mask) != 0 && (inside || Box(bdy.Bounds).Overlaps(bnd)))
+				elements.push_back(handle);
+		}
+	}
+	void QuadTree::m_findPairs(unsigned int node, std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB, std::vector<std::pair<BodyHandle, Box>>& leaf) const
+	{
+		const Node& n = m_nodes[node];
+
+		if (n.FirstChild != None) {
+			for (unsigned int i = 0; i < 4; i++)
+				m_findPairs(n.FirstChild + i, pairs, typeA, typeB, leaf);
+			return;
+		}
+
+		// get the bounds of the elements we are interested in
+		leaf.clear();
+		for (unsigned int el = n.FirstElement; el != None; el = m_elements[el].Next) {
+			const Body& bdy = (*m_bodies)[m_elements[el].Handle];
+			if (bdy.Type == typeA || bdy.Type == typeB)
+				leaf.push_back(std::make_pair(m_elements[el].Handle, Box(bdy.Bounds)));
+		}
+
+		for (size_t i = 0; i < leaf.size(); i++) {
+			for (size_t j = i + 1; j < leaf.size(); j++) {
+				const Box& a = leaf[i].second;
+				const Box& b = leaf[j].second;
+				if (!a.Overlaps(b))
+					continue;
+
+				// a pair that is stored in multiple leaves is only reported by the leaf that contains
+				// the top left corner of the overlap (leaves dont share any points, a leaf owns its
+				// left and top edge but not its right and bottom edge)
+				float x = std::max(a.MinX, b.MinX);
+				float y = std::max(a.MinY, b.MinY);
+				if (x < n.Bounds.MinX || x >= n.Bounds.MaxX || y < n.Bounds.MinY || y >= n.Bounds.MaxY)
+					continue;
+
+				m_addPair(pairs, leaf[i].first, leaf[j].first, typeA, typeB);
+			}
+		}
+	}
+	void QuadTree::m_merge(unsigned int node)
+	{
+		Node& n = m_nodes[node];
+		unsigned int first = n.FirstChild;
+
+		// we can only merge leaves
+		for (unsigned int c = 0; c < 4; c++)
+			if (m_nodes[first + c].FirstChild != None)
+				return;
+
+		// count the unique elements - objects that are on the border between nodes are stored in multiple children
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+		int count = 0;
+		for (unsigned int c = 0; c < 4; c++) {
+			for (unsigned int el = m_nodes[first + c].FirstElement; el != None; el = m_elements[el].Next) {
+				BodyHandle handle = m_elements[el].Handle;
+				if (stamps[handle] == stamp)
+					continue;
+				stamps[handle] = stamp;
+
+				count++;
+				if (count > m_maxCapacity)
+					return; // too many elements, keep the children
+			}
+		}
+
+		// move the elements to this node (dropping the duplicates) and give the children back to the pool
+		stamp = m_nextStamp(stamps);
+		for (unsigned int c = 0; c < 4; c++) {
+			unsigned int el = m_nodes[first + c].FirstElement;
+			while (el != None) {
+				unsigned int next = m_elements[el].Next;
+				BodyHandle handle = m_elements[el].Handle;
+
+				if (stamps[handle] != stamp) {
+					stamps[handle] = stamp;
+					m_elements[el].Next = n.FirstElement;
+					n.FirstElement = el;
+					n.Count++;
+				} else {
+					m_elements[el].Next = m_freeElement;
+					m_freeElement = el;
+				}
+
+				el = next;
+			}
+		}
+
+		m_freeNodes.push_back(first);
+		n.FirstChild = None;
+	}
+	void QuadTree::m_grow(const Box& bnds)
+	{
+		while (!m_nodes[0].Bounds.Contains(bnds)) {
+			Node old = m_nodes[0];
+			Box cur = old.Bounds;
+			float width = cur.MaxX - cur.MinX;
+			float height = cur.MaxY - cur.MinY;
+
+			// grow in the direction of the rectangle
+			bool growLeft = bnds.MinX < cur.MinX;
+			bool growUp = bnds.MinY < cur.MinY;
+
+			Node& root = m_nodes[0];
+			root.Bounds = Box(growLeft ? cur.MinX - width : cur.MinX,
+				growUp ? cur.MinY - height : cur.MinY,
+				growLeft ? cur.MaxX : cur.MaxX + width,
+				growUp ? cur.MaxY : cur.MaxY + height);
+			root.FirstElement = None;
+			root.Count = 0;
+
+			// the current root becomes one of the quadrants of the new root
+			m_split(0, growLeft ? cur.MinX : cur.MaxX, growUp ? cur.MinY : cur.MaxY);
+
+			unsigned int slot = m_nodes[0].FirstChild + (growUp ? 2 : 0) + (growLeft ? 1 : 0);
+			m_nodes[slot] = old;
+		}
+	}
+	bool QuadTree::m_shouldSplit(unsigned int node, const Box& bnds) const
+	{
+		const Box& nb = m_nodes[node].Bounds;
+		float midX = (nb.MinX + nb.MaxX) / 2;
+		float midY = (nb.MinY + nb.MaxY) / 2;
+		Box quads[4] = {
+			Box(nb.MinX, nb.MinY, midX, midY), Box(midX, nb.MinY, nb.MaxX, midY),
+			Box(nb.MinX, midY, midX, nb.MaxY), Box(midX, midY, nb.MaxX, nb.MaxY)
+		};
+
+		// count how many copies of the elements the children would hold
+		int copies = 0;
+		for (unsigned int i = 0; i < 4; i++)
+			copies += quads[i].Overlaps(bnds);
+
+		for (unsigned int el = m_nodes[node].FirstElement; el != None; el = m_elements[el].Next) {
+			Box elBounds((*m_bodies)[m_elements[el].Handle].Bounds);
+			for (unsigned int i = 0; i < 4; i++)
+				copies += quads[i].Overlaps(elBounds);
+		}
+
+		// splitting is only worth it if most of the elements end up in a single child
+		return copies < 2 * (m_nodes[node].Count + 1);
+	}
+	void QuadTree::m_subdivide(unsigned int node, int depth)
+	{
+		const Box& bnds = m_nodes[node].Bounds;
+		m_split(node, (bnds.MinX + bnds.MaxX) / 2, (bnds.MinY + bnds.MaxY) / 2);
+
+		// take the elements away from this node and put them in the children
+		unsigned int child = m_nodes[node].FirstChild;
+		unsigned int el = m_nodes[node].FirstElement;
+		m_nodes[node].FirstElement = None;
+		m_nodes[node].Count = 0;
+
+		while (el != None) {
+			unsigned int next = m_elements[el].Next;
+			BodyHandle handle = m_elements[el].Handle;
+
+			m_elements[el].Next = m_freeElement;
+			m_freeElement = el;
+
+			Box elBounds((*m_bodies)[handle].Bounds);
+			for (unsigned int i = 0; i < 4; i++)
+				m_insert(child + i, depth + 1, handle, elBounds);
+
+			el = next;
+		}
+	}
+	void QuadTree::m_split(unsigned int node, float midX, float midY)
+	{
+		unsigned int child = m_allocateNodes();
+		Box bnds = m_nodes[node].Bounds;
+
+		m_nodes[node].FirstChild = child;
+		m_nodes[child + 0].Bounds = Box(bnds.MinX, bnds.MinY, midX, midY);
+		m_nodes[child + 1].Bounds = Box(midX, bnds.MinY, bnds.MaxX, midY);
+		m_nodes[child + 2].Bounds = Box(bnds.MinX, midY, midX, bnds.MaxY);
+		m_nodes[child + 3].Bounds = Box(midX, midY, bnds.MaxX, bnds.MaxY);
+		for (unsigned int i = 0; i < 4; i++) {
+			m_nodes[child + i].FirstChild = None;
+			m_nodes[child + i].FirstElement = None;
+			m_nodes[child + i].Count = 0;
+			m_nodes[child + i].Categories = 0;
+		}
+	}
+	unsigned int QuadTree::m_allocateNodes()
+	{
+		if (!m_freeNodes.empty()) {
+			unsigned int ret = m_freeNodes.back();
+			m_freeNodes.pop_back();
+			return ret;
+		}
+
+		COLLY_COUNT_GROWTH(m_nodes);
+		unsigned int ret = (unsigned int)m_nodes.size();
+		m_nodes.resize(m_nodes.size() + 4);
+		return ret;
+	}
+	void QuadTree::m_addElement(unsigned int node, BodyHandle handle)
+	{
+		unsigned int el = m_freeElement;
+		if (el != None)
+			m_freeElement = m_elements[el].Next;
+		else {
+			COLLY_COUNT_GROWTH(m_elements);
+			el = (unsigned int)m_elements.size();
+			m_elements.push_back(Element());
+		}
+
+		m_elements[el].Handle = handle;
+		m_elements[el].Next = m_nodes[node].FirstElement;
+		m_nodes[node].FirstElement = el;
+		m_nodes[node].Count++;
+	}
+	void QuadTree::m_updateCategories(unsigned int node)
+	{
+		Node& n = m_nodes[node];
+		n.Categories = 0;
+		if (n.FirstChild != None) {
+			for (unsigned int i = 0; i < 4; i++)
+				n.Categories |= m_nodes[n.FirstChild + i].Categories;
+		} else {
+			for (unsigned int el = n.FirstElement; el != None; el = m_elements[el].Next)
+				n.Categories |= (*m_bodies)[m_elements[el].Handle].Category;
+		}
+	}
+	unsigned int BroadPhase::m_nextStamp(unsigned int*& stamps) const
+	{
+		if (visited.Stamps.size() < m_bodies->size()) {
+			COLLY_COUNT_GROWTH(visited.Stamps);
+			visited.Stamps.resize(m_bodies->size(), 0);
+		}
+
+		// start over when the counter wraps around so that old stamps cant match the new ones
+		visited.Stamp++;
+		if (visited.Stamp == 0) {
+			std::fill(visited.Stamps.begin(), visited.Stamps.end(), 0);
+			visited.Stamp = 1;
+		}
+
+		stamps = visited.Stamps.data();
+		return visited.Stamp;
+	}
+
+
+
+	constexpr unsigned int SweepAndPrune::None;
+
+	SweepAndPrune::SweepAndPrune(const std::vector<Body>& bodies) :
+		BroadPhase(bodies), m_dirty(false)
+	{
+		Reset(Rect());
+	}
+	void SweepAndPrune::Reset(const Rect& /*bnds*/)
+	{
+		for (int axis = 0; axis < 2; axis++) {
+			m_lists[axis].clear();
+			m_positions[axis].clear();
+			m_maxSize[axis] = 0;
+		}
+		m_sorted = 0;
+		m_removed = 0;
+		m_dirty = false;
+	}
+	void SweepAndPrune::Insert(BodyHandle handle)
+	{
+		Entry entry;
+		entry.Bounds = Box((*m_bodies)[handle].Bounds);
+		entry.Handle = handle;
+
+		// just add it to the end, it will be sorted before the next query
+		for (int axis = 0; axis < 2; axis++) {
+			if (m_positions[axis].size() <= handle)
+				m_positions[axis].resize(handle + 1, None);
+
+			m_positions[axis][handle] = (unsigned int)m_lists[axis].size();
+			m_lists[axis].push_back(entry);
+		}
+
+		// make the size a tiny bit bigger so that rounding errors in Query cant skip this object
+		m_maxSize[0] = std::max(m_maxSize[0], std::nextafter(entry.Bounds.MaxX - entry.Bounds.MinX, std::numeric_limits<float>::infinity()));
+		m_maxSize[1] = std::max(m_maxSize[1], std::nextafter(entry.Bounds.MaxY - entry.Bounds.MinY, std::numeric_limits<float>::infinity()));
+
+		m_dirty = true;
+	}
+	void SweepAndPrune::Remove(BodyHandle handle)
+	{
+		m_flush();
+
+		// leave the entry in the list (so that the list stays sorted) and skip it in queries
+		for (int axis = 0; axis < 2; axis++) {
+			m_lists[axis][m_positions[axis][handle]].Handle = None;
+			m_positions[axis][handle] = None;
+		}
+		m_removed++;
+
+		// get rid of the removed entries once they take up half of the list
+		if (m_removed * 2 > m_lists[0].size()) {
+			m_dirty = true;
+			m_flush();
+		}
+	}
+	void SweepAndPrune::Move(BodyHandle handle, const Rect& /*oldBounds*/)
+	{
+		m_flush();
+
+		Box bnds((*m_bodies)[handle].Bounds);
+		m_maxSize[0] = std::max(m_maxSize[0], std::nextafter(bnds.MaxX - bnds.MinX, std::numeric_limits<float>::infinity()));
+		m_maxSize[1] = std::max(m_maxSize[1], std::nextafter(bnds.MaxY - bnds.MinY, std::numeric_limits<float>::infinity()));
+
+		for (int axis = 0; axis < 2; axis++) {
+			unsigned int index = m_positions[axis][handle];
+			m_lists[axis][index].Bounds = bnds;
+			m_shift(axis, index);
+		}
+	}
+	void SweepAndPrune::Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask) const
+	{
+		m_flush();
+
+		// find the entries that start before the region ends and dont end before the region starts
+		// on each axis and go through the shorter list
+		size_t begin[2], end[2];
+		for (int axis = 0; axis < 2; axis++) {
+			const std::vector<Entry>& list = m_lists[axis];
+			float minEdge = axis == 0 ? bnd.MinX : bnd.MinY;
+			float maxEdge = axis == 0 ? bnd.MaxX : bnd.MaxY;
+			float from = std::nextafter(minEdge - m_maxSize[axis], -std::numeric_limits<float>::infinity());
+
+			begin[axis] = std::lower_bound(list.begin(), list.end(), from, [axis](const Entry& e, float value) {
+				return (axis == 0 ? e.Bounds.MinX : e.Bounds.MinY) < value;
+			}) - list.begin();
+			end[axis] = std::lower_bound(list.begin() + begin[axis], list.end(), maxEdge, [axis](const Entry& e, float value) {
+				return (axis == 0 ? e.Bounds.MinX : e.Bounds.MinY) < value;
+			}) - list.begin();
+		}
+
+		int axis = (end[0] - begin[0] <= end[1] - begin[1]) ? 0 : 1;
+		const std::vector<Entry>& list = m_lists[axis];
+		COLLY_STAT(NodesVisited, end[axis] - begin[axis]);
+		COLLY_COUNT_RESULTS(elements);
+		for (size_t i = begin[axis]; i < end[axis]; i++) {
+			const Entry& e = list[i];
+			if (e.Handle == None || !e.Bounds.Overlaps(bnd))
+				continue;
+
+			const Body& bdy = (*m_bodies)[e.Handle];
+			if (bdy.Type != CollisionType::None && (bdy.Category & mask) != 0)
+				elements.push_back(e.Handle);
+		}
+	}
+	void SweepAndPrune::Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const
+	{
+		m_flush();
+
+		// go through the list sorted along the axis the ray moves along the most, in the direction it moves
+		int axis = std::abs(dx) >= std::abs(dy) ? 0 : 1;
+		float start = axis == 0 ? from.X : from.Y, d = axis == 0 ? dx : dy;
+		float otherMin = axis == 0 ? std::min(from.Y, from.Y + dy) : std::min(from.X, from.X + dx);
+		float otherMax = axis == 0 ? std::max(from.Y, from.Y + dy) : std::max(from.X, from.X + dx);
+
+		const std::vector<Entry>& list = m_lists[axis];
+		auto minEdge = [axis](const Entry& e) { return axis == 0 ? e.Bounds.MinX : e.Bounds.MinY; };
+
+		auto visit = [&](const Entry& e) {
+			if (e.Handle == None || (axis == 0 ? (e.Bounds.MaxY < otherMin || e.Bounds.MinY > otherMax) : (e.Bounds.MaxX < otherMin || e.Bounds.MinX > otherMax)))
+				return;
+			if ((*m_bodies)[e.Handle].Type != CollisionType::None)
+				limit = visitor.Visit(e.Handle);
+		};
+
+		if (d >= 0) {
+			// entries that end before the ray starts cant be hit, stop at the first one that starts after the closest hit
+			float first = std::nextafter(start - m_maxSize[axis], -std::numeric_limits<float>::infinity());
+			size_t i = std::lower_bound(list.begin(), list.end(), first, [&](const Entry& e, float value) { return minEdge(e) < value; }) - list.begin();
+			for (; i < list.size(); i++) {
+				float edge = minEdge(list[i]);
+				if (edge > start && (d == 0 || (edge - start) / d > limit + RaySlack))
+					break;
+				visit(list[i]);
+			}
+		} else {
+			// entries that start after the ray starts cant be hit, stop at the first one that ends (at most m_maxSize
+			// after it starts) before the closest hit
+			size_t i = std::upper_bound(list.begin(), list.end(), start, [&](float value, const Entry& e) { return value < minEdge(e); }) - list.begin();
+			while (i-- > 0) {
+				float edge = minEdge(list[i]) + m_maxSize[axis];
+				if (edge < start && (edge - start) / d > limit + RaySlack)
+					break;
+				visit(list[i]);
+			}
+		}
+	}
+	void SweepAndPrune::FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const
+	{
+		if (typeA == CollisionType::None || typeB == CollisionType::None)
+			return;
+
+		m_flush();
+
+		// sweep along the x axis - each entry is tested with the entries that start before it ends
+		const std::vector<Entry>& list = m_lists[0];
+		for (size_t i = 0; i < list.size(); i++) {
+			const Entry& a = list[i];
+			if (a.Handle == None)
+				continue;
+
+			CollisionType aType = (*m_bodies)[a.Handle].Type;
+			if (aType != typeA && aType != typeB)
+				continue;
+
+			for (size_t j = i + 1; j < list.size() && list[j].Bounds.MinX < a.Bounds.MaxX; j++) {
+				const Entry& b = list[j];
+				if (b.Handle == None || !a.Bounds.Overlaps(b.Bounds))
+					continue;
+
+				m_addPair(pairs, a.Handle, b.Handle, typeA, typeB);
+			}
+		}
+	}
+	void SweepAndPrune::m_flush() const
+	{
+		if (!m_dirty)
+			return;
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_dirty)
+			return; // some other thread did it while we were waiting
+
+		for (int axis = 0; axis < 2; axis++) {
+			std::vector<Entry>& list = m_lists[axis];
+			auto less = [axis](const Entry& a, const Entry& b) {
+				return axis == 0 ? a.Bounds.MinX < b.Bounds.MinX : a.Bounds.MinY < b.Bounds.MinY;
+			};
+
+			// drop the removed entries
+			if (m_removed > 0)
+				list.erase(std::remove_if(list.begin(), list.end(), [](const Entry& e) { return e.Handle == None; }), list.end());
+
+			// sort the new entries and merge them with the sorted ones
+			size_t sorted = std::min(m_sorted, list.size());
+			if (m_removed > 0)
+				sorted = 0; // we dont know how many of the removed entries were sorted, so sort everything
+
+			std::sort(list.begin() + sorted, list.end(), less);
+			std::inplace_merge(list.begin(), list.begin() + sorted, list.end(), less);
+
+			for (size_t i = 0; i < list.size(); i++)
+				m_positions[axis][list[i].Handle] = (unsigned int)i;
+		}
+
+		m_sorted = m_lists[0].size();
+		m_removed = 0;
+		m_dirty = false;
+	}
+	void SweepAndPrune::m_shift(int axis, unsigned int index)
+	{
+		std::vector<Entry>& list = m_lists[axis];
+		std::vector<unsigned int>& positions = m_positions[axis];
+		auto key = [axis](const Entry& e) { return axis == 0 ? e.Bounds.MinX : e.Bounds.MinY; };
+		float value = key(list[index]);
+
+		// insertion sort - swap with the neighbours until the entry is in the right place
+		while (index > 0 && key(list[index - 1]) > value) {
+			std::swap(list[index - 1], list[index]);
+			if (list[index].Handle != None)
+				positions[list[index].Handle] = index;
+			index--;
+		}
+		while (index + 1 < list.size() && key(list[index + 1]) < value) {
+			std::swap(list[index + 1], list[index]);
+			if (list[index].Handle != None)
+				positions[list[index].Handle] = index;
+			index++;
+		}
+
+		if (list[index].Handle != None)
+			positions[list[index].Handle] = index;
+	}
+
+
+
+	constexpr float SpatialHash::DefaultCellSize;
+	constexpr int SpatialHash::MaxCells;
+
+	SpatialHash::SpatialHash(const std::vector<Body>& bodies, float cellSize) :
+		BroadPhase(bodies)
+	{
+		m_cellSize = cellSize > 0 ? cellSize : DefaultCellSize;
+		m_invCellSize = 1.0f / m_cellSize;
+	}
+	void SpatialHash::SetCellSize(float size)
+	{
+		if (size <= 0 || size == m_cellSize)
+			return;
+
+		// collect all the objects we have, change the size and insert them again
+		std::vector<BodyHandle> handles = m_large;
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+		for (auto& cell : m_cells)
+			for (BodyHandle handle : cell.second)
+				if (stamps[handle] != stamp) {
+					stamps[handle] = stamp;
+					handles.push_back(handle);
+				}
+
+		Reset(Rect());
+		m_cellSize = size;
+		m_invCellSize = 1.0f / size;
+
+		for (BodyHandle handle : handles)
+			Insert(handle);
+	}
+	void SpatialHash::Reset(const Rect& /*bnds*/)
+	{
+		m_cells.clear();
+		m_large.clear();
+	}
+	void SpatialHash::Insert(BodyHandle handle)
+	{
+		m_insert(handle, m_getRange(Box((*m_bodies)[handle].Bounds)));
+	}
+	void SpatialHash::Remove(BodyHandle handle)
+	{
+		m_remove(handle, m_getRange(Box((*m_bodies)[handle].Bounds)));
+	}
+	void SpatialHash::Move(BodyHandle handle, const Rect& oldBounds)
+	{
+		CellRange from = m_getRange(Box(oldBounds));
+		CellRange to = m_getRange(Box((*m_bodies)[handle].Bounds));
+
+		if (from.MinX == to.MinX && from.MinY == to.MinY && from.MaxX == to.MaxX && from.MaxY == to.MaxY)
+			return; // still in the same cells
+
+		if (m_isLarge(from) || m_isLarge(to)) {
+			m_remove(handle, from);
+			m_insert(handle, to);
+			return;
+		}
+
+		// only update the cells that changed
+		for (int y = from.MinY; y <= from.MaxY; y++)
+			for (int x = from.MinX; x <= from.MaxX; x++)
+				if (x < to.MinX || x > to.MaxX || y < to.MinY || y > to.MaxY) {
+					std::vector<BodyHandle>& cell = m_cells[CellHash::Key(x, y)];
+					auto it = std::find(cell.begin(), cell.end(), handle);
+					*it = cell.back();
+					cell.pop_back();
+				}
+
+		for (int y = to.MinY; y <= to.MaxY; y++)
+			for (int x = to.MinX; x <= to.MaxX; x++)
+				if (x < from.MinX || x > from.MaxX || y < from.MinY || y > from.MaxY)
+					m_cells[CellHash::Key(x, y)].push_back(handle);
+	}
+	void SpatialHash::Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask) const
+	{
+		COLLY_COUNT_RESULTS(elements);
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+		m_gather(m_getRange(bnd), bnd, mask, elements, stamps, stamp);
+
+		for (BodyHandle handle : m_large) {
+			const Body& bdy = (*m_bodies)[handle];
+			if (bdy.Type != CollisionType::None && (bdy.Category & mask) != 0 && Box(bdy.Bounds).Overlaps(bnd))
+				elements.push_back(handle);
+		}
+	}
+	void SpatialHash::Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const
+	{
+		unsigned int* stamps;
+		unsigned int stamp = m_nextStamp(stamps);
+
+		auto visit = [&](const std::vector<BodyHandle>& cell) {
+			for (BodyHandle handle : cell) {
+				if (stamps[handle] == stamp)
+					continue;
+				stamps[handle] = stamp;
+
+				if ((*m_bodies)[handle].Type != CollisionType::None)
+					limit = visitor.Visit(handle);
+			}
+		};
+
+		visit(m_large);
+
+		// cut the ray into pieces that arent longer than a cell (on both axes) and look at the cells under each piece -
+		// pieces are a bit bigger so that rounding errors cant make us skip a cell
+		float pad = std::max(m_cellSize * 0.01f, (std::abs(from.X) + std::abs(from.Y) + std::abs(dx) + std::abs(dy)) * 1e-6f);
+		double pieces = std::max(std::ceil(std::max(std::abs(dx), std::abs(dy)) * (double)m_invCellSize), 1.0);
+
+		// if the ray goes thru more cells than we have, go through all the cells we have instead
+		if (pieces * 4 > (double)m_cells.size()) {
+			CellRange range = m_getRange(Box(std::min(from.X, from.X + dx) - pad, std::min(from.Y, from.Y + dy) - pad,
+				std::max(from.X, from.X + dx) + pad, std::max(from.Y, from.Y + dy) + pad));
+			for (auto& cell : m_cells) {
+				int x = (int)(unsigned int)(cell.first >> 32);
+				int y = (int)(unsigned int)(cell.first & 0xFFFFFFFF);
+				if (x >= range.MinX && x <= range.MaxX && y >= range.MinY && y <= range.MaxY)
+					visit(cell.second);
+			}
+			return;
+		}
+
+		int count = (int)pieces;
+		for (int i = 0; i < count; i++) {
+			float t0 = (float)i / count, t1 = (float)(i + 1) / count;
+			if (t0 > limit + RaySlack)
+				break;
+
+			Point a = { from.X + dx * t0, from.Y + dy * t0 }, b = { from.X + dx * t1, from.Y + dy * t1 };
+			CellRange range = m_getRange(Box(std::min(a.X, b.X) - pad, std::min(a.Y, b.Y) - pad, std::max(a.X, b.X) + pad, std::max(a.Y, b.Y) + pad));
+			for (int y = range.MinY; y <= range.MaxY; y++)
+				for (int x = range.MinX; x <= range.MaxX; x++) {
+					auto it = m_cells.find(CellHash::Key(x, y));
+					if (it != m_cells.end())
+						visit(it->second);
+				}
+		}
+	}
+	void SpatialHash::FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const
+	{
+		if (typeA == CollisionType::None || typeB == CollisionType::None)
+			return;
+
+		// pairs of objects in the same cell
+		std::vector<std::pair<BodyHandle, Box>> objects;
+		for (auto& cell : m_cells) {
+			int cellX = (int)(unsigned int)(cell.first >> 32);
+			int cellY = (int)(unsigned int)(cell.first & 0xFFFFFFFF);
+
+			objects.clear();
+			for (BodyHandle handle : cell.second) {
+				const Body& bdy = (*m_bodies)[handle];
+				if (bdy.Type == typeA || bdy.Type == typeB)
+					objects.push_back(std::make_pair(handle, Box(bdy.Bounds)));
+			}
+
+			for (size_t i = 0; i < objects.size(); i++) {
+				for (size_t j = i + 1; j < objects.size(); j++) {
+					const Box& a = objects[i].second;
+					const Box& b = objects[j].second;
+					if (!a.Overlaps(b))
+						continue;
+
+					// a pair that shares multiple cells is only reported by the cell that contains the top left corner of the overlap
+					Box corner;
+					corner.MinX = corner.MaxX = std::max(a.MinX, b.MinX);
+					corner.MinY = corner.MaxY = std::max(a.MinY, b.MinY);
+					CellRange owner = m_getRange(corner);
+					if (owner.MinX != cellX || owner.MinY != cellY)
+						continue;
+
+					m_addPair(pairs, objects[i].first, objects[j].first, typeA, typeB);
+				}
+			}
+		}
+
+		// pairs with large objects - they arent stored in the cells so nothing above could find them
+		std::vector<BodyHandle> nearby;
+		for (size_t i = 0; i < m_large.size(); i++) {
+			const Body& bdy = (*m_bodies)[m_large[i]];
+			if (bdy.Type != typeA && bdy.Type != typeB)
+				continue;
+
+			Box bnd(bdy.Bounds);
+			nearby.clear();
+			unsigned int* stamps;
+			unsigned int stamp = m_nextStamp(stamps);
+			m_gather(m_getRange(bnd), bnd, bdy.Mask, nearby, stamps, stamp);
+			for (size_t j = i + 1; j < m_large.size(); j++)
+				if (Box((*m_bodies)[m_large[j]].Bounds).Overlaps(bnd))
+					nearby.push_back(m_large[j]);
+
+			for (BodyHandle other : nearby)
+				m_addPair(pairs, m_large[i], other, typeA, typeB);
+		}
+	}
+	SpatialHash::CellRange SpatialHash::m_getRange(const Box& bnds) const
+	{
+		// keep the coordinates in a range where the number of cells cant overflow
+		auto toCell = [&](float value) {
+			float cell = std::floor(value * m_invCellSize);
+			return (int)std::min(std::max(cell, -1073741824.0f), 1073741824.0f);
+		};
+
+		CellRange range;
+		range.MinX = toCell(bnds.MinX);
+		range.MinY = toCell(bnds.MinY);
+		range.MaxX = toCell(bnds.MaxX);
+		range.MaxY = toCell(bnds.MaxY);
+		return range;
+	}
+	void SpatialHash::m_insert(BodyHandle handle, const CellRange& range)
+	{
+		if (m_isLarge(range)) {
+			m_large.push_back(handle);
+			return;
+		}
+
+		for (int y = range.MinY; y <= range.MaxY; y++)
+			for (int x = range.MinX; x <= range.MaxX; x++)
+				m_cells[CellHash::Key(x, y)].push_back(handle);
+	}
+	void SpatialHash::m_remove(BodyHandle handle, const CellRange& range)
+	{
+		if (m_isLarge(range)) {
+			auto it = std::find(m_large.begin(), m_large.end(), handle);
+			*it = m_large.back();
+			m_large.pop_back();
+			return;
+		}
+
+		// cells are small, so finding the object and swapping it with the last one is cheap
+		for (int y = range.MinY; y <= range.MaxY; y++)
+			for (int x = range.MinX; x <= range.MaxX; x++) {
+				std::vector<BodyHandle>& cell = m_cells[CellHash::Key(x, y)];
+				auto it = std::find(cell.begin(), cell.end(), handle);
+				*it = cell.back();
+				cell.pop_back();
+			}
+	}
+	void SpatialHash::m_gather(const CellRange& range, const Box& bnd, uint32_t mask, std::vector<BodyHandle>& elements, unsigned int* stamps, unsigned int stamp) const
+	{
+		auto visit = [&](const std::vector<BodyHandle>& cell) {
+			COLLY_STAT(NodesVisited, 1);
+			for (BodyHandle handle : cell) {
+				if (stamps[handle] == stamp)
+					continue; // already checked in some other cell
+				stamps[handle] = stamp;
+
+				const Body& bdy = (*m_bodies)[handle];
+				if (bdy.Type != CollisionType::None && (bdy.Category & mask) != 0 && Box(bdy.Bounds).Overlaps(bnd))
+					elements.push_back(handle);
+			}
+		};
+
+		// if the region covers more cells than we have, go through all the cells we have instead
+		long long count = (long long)(range.MaxX - range.MinX + 1) * (range.MaxY - range.MinY + 1);
+		if (count > (long long)m_cells.size()) {
+			for (auto& cell : m_cells) {
+				int x = (int)(unsigned int)(cell.first >> 32);
+				int y = (int)(unsigned int)(cell.first & 0xFFFFFFFF);
+				if (x >= range.MinX && x <= range.MaxX && y >= range.MinY && y <= range.MaxY)
+					visit(cell.second);
+			}
+		} else {
+			for (int y = range.MinY; y <= range.MaxY; y++)
+				for (int x = range.MinX; x <= range.MaxX; x++) {
+					auto it = m_cells.find(CellHash::Key(x, y));
+					if (it != m_cells.end())
+						visit(it->second);
+				}
+		}
+	}
+
+
+
+	constexpr int PackedTree::Width;
+	constexpr unsigned int PackedTree::None;
+
+	PackedTree::PackedTree(const std::vector<Body>& bodies) :
+		BroadPhase(bodies), m_firstLeaf(0), m_dirty(false)
+	{}
+	void PackedTree::Reset(const Rect& /*bnds*/)
+	{
+		// the tree is always built to fit the objects, so we dont need the bounds
+		m_handles.clear();
+		m_positions.clear();
+		m_nodes.clear();
+		m_firstLeaf = 0;
+		m_dirty = false;
+	}
+	void PackedTree::Insert(BodyHandle handle)
+	{
+		if (m_positions.size() <= handle)
+			m_positions.resize(handle + 1, None);
+
+		m_positions[handle] = (unsigned int)m_handles.size();
+		m_handles.push_back(handle);
+		m_dirty = true;
+	}
+	void PackedTree::Remove(BodyHandle handle)
+	{
+		// move the last object to its place in the list
+		unsigned int pos = m_positions[handle];
+		m_handles[pos] = m_handles.back();
+		m_positions[m_handles[pos]] = pos;
+		m_handles.pop_back();
+		m_positions[handle] = None;
+		m_dirty = true;
+	}
+	void PackedTree::Move(BodyHandle /*handle*/, const Rect& /*oldBounds*/)
+	{
+		m_dirty = true;
+	}
+	void PackedTree::Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask) const
+	{
+		COLLY_COUNT_RESULTS(elements);
+		m_visit(bnd, mask, [&](BodyHandle handle, size_t /*index*/) {
+			if ((*m_bodies)[handle].Type != CollisionType::None)
+				elements.push_back(handle);
+		});
+	}
+	void PackedTree::FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const
+	{
+		if (typeA == CollisionType::None || typeB == CollisionType::None)
+			return;
+
+		m_flush();
+
+		// query the tree with every object - a pair is added by the object that comes first in the leaves
+		for (size_t leaf = m_firstLeaf; leaf < m_nodes.size(); leaf++) {
+			const Node& n = m_nodes[leaf];
+			for (int i = 0; i < Width && n.Child[i] != None; i++) {
+				BodyHandle handle = n.Child[i];
+				CollisionType type = (*m_bodies)[handle].Type;
+				if (type != typeA && type != typeB)
+					continue;
+
+				size_t index = (leaf - m_firstLeaf) * Width + i;
+				m_visit(Box(n.MinX[i], n.MinY[i], n.MaxX[i], n.MaxY[i]), (*m_bodies)[handle].Mask, [&](BodyHandle other, size_t otherIndex) {
+					if (otherIndex > index)
+						m_addPair(pairs, handle, other, typeA, typeB);
+				});
+			}
+		}
+	}
+	void PackedTree::Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const
+	{
+		m_flush();
+		if (m_nodes.empty())
+			return;
+
+		// nodes we still have to look at + when the ray gets to them, the closest one is always on the top
+		std::pair<float, unsigned int> stack[32 * Width];
+		size_t count = 0;
+		stack[count++] = std::make_pair(0.0f, 0u);
+
+		while (count > 0) {
+			std::pair<float, unsigned int> top = stack[--count];
+			if (top.first > limit)
+				continue;
+
+			// sort the children the ray goes thru by when it gets to them
+			const Node& n = m_nodes[top.second];
+			std::pair<float, unsigned int> order[Width];
+			int hits = 0;
+			for (int i = 0; i < Width && n.Child[i] != None; i++) {
+				float entry;
+				if (segmentTouches(from, dx, dy, Box(n.MinX[i], n.MinY[i], n.MaxX[i], n.MaxY[i]), entry) && entry <= limit)
+					insertSorted(order, hits, std::make_pair(entry, n.Child[i]));
+			}
+
+			if (top.second >= m_firstLeaf) {
+				for (int i = 0; i < hits && order[i].first <= limit; i++)
+					if ((*m_bodies)[order[i].second].Type != CollisionType::None)
+						limit = visitor.Visit(order[i].second);
+				continue;
+			}
+
+			// push the furthest child first so that we continue with the closest one
+			for (int i = hits - 1; i >= 0; i--)
+				stack[count++] = order[i];
+		}
+	}
+	void PackedTree::Save(std::vector<unsigned char>& data) const
+	{
+		m_flush();
+
+		writeValue(data, (uint32_t)Width);
+		writeValue(data, m_firstLeaf);
+		writeArray(data, m_nodes.data(), m_nodes.size());
+		writeArray(data, m_handles.data(), m_handles.size());
+	}
+	bool PackedTree::Load(const unsigned char* data, size_t size)
+	{
+		Reader reader = { data, size, 0 };
+		uint32_t width;
+		unsigned int firstLeaf;
+		std::vector<Node> nodes;
+		std::vector<BodyHandle> handles;
+		if (!reader.Read(width) || !reader.Read(firstLeaf) || !reader.ReadArray(nodes) || !reader.ReadArray(handles))
+			return false;
+
+		if (width != Width || (nodes.empty() ? firstLeaf != 0 : firstLeaf >= nodes.size()))
+			return false;
+
+		std::vector<unsigned int> positions;
+		for (size_t i = 0; i < handles.size(); i++) {
+			BodyHandle handle = handles[i];
+			if (handle >= m_bodies->size())
+				return false;
+			if (positions.size() <= handle)
+				positions.resize(handle + 1, None);
+			if (positions[handle] != None)
+				return false;
+			positions[handle] = (unsigned int)i;
+		}
+
+		// make sure that all the indices point inside of the arrays so that a broken file cant crash us - every
+		// node must have one parent that comes before it (so there are no loops) and the tree cant be deeper than
+		// 32 levels (so that the stack in Raycast and m_visit is big enough)
+		const float inf = std::numeric_limits<float>::infinity();
+		std::vector<unsigned char> depth(nodes.size(), 0xFF);
+		if (!nodes.empty())
+			depth[0] = 0;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (depth[i] >= 32)
+				return false;
+
+			for (int j = 0; j < Width; j++) {
+				unsigned int child = nodes[i].Child[j];
+				if (child == None) {
+					// empty slots must never overlap anything
+					nodes[i].MinX[j] = nodes[i].MinY[j] = inf;
+					nodes[i].MaxX[j] = nodes[i].MaxY[j] = -inf;
+					nodes[i].Categories[j] = 0;
+					continue;
+				}
+
+				if (i >= firstLeaf) {
+					if (child >= m_bodies->size())
+						return false;
+				} else {
+					if (child <= i || child >= nodes.size() || depth[child] != 0xFF)
+						return false;
+					depth[child] = depth[i] + 1;
+				}
+			}
+		}
+
+		// take the layers from the bodies (children always come after their parents, so we can go from the end)
+		for (size_t i = nodes.size(); i-- > 0;) {
+			for (int j = 0; j < Width; j++) {
+				unsigned int child = nodes[i].Child[j];
+				if (child == None)
+					continue;
+
+				if (i >= firstLeaf)
+					nodes[i].Categories[j] = (*m_bodies)[child].Category;
+				else {
+					nodes[i].Categories[j] = 0;
+					for (int k = 0; k < Width; k++)
+						nodes[i].Categories[j] |= nodes[child].Categories[k];
+				}
+			}
+		}
+
+		m_handles.swap(handles);
+		m_positions.swap(positions);
+		m_nodes.swap(nodes);
+		m_firstLeaf = firstLeaf;
+		m_dirty = false;
+		return true;
+	}
+	void PackedTree::m_flush() const
+	{
+		if (!m_dirty)
+			return;
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_dirty)
+			return; // some other thread did it while we were waiting
+
+		// objects with no area cant overlap anything or be hit by a ray, so they dont have to be in the nodes
+		std::vector<std::pair<uint32_t, BodyHandle>> order;
+		order.reserve(m_handles.size());
+		double minX = std::numeric_limits<double>::infinity(), minY = minX, maxX = -minX, maxY = -minX;
+		for (BodyHandle handle : m_handles) {
+			Box b((*m_bodies)[handle].Bounds);
+			if (!(b.MinX < b.MaxX && b.MinY < b.MaxY))
+				continue;
+
+			double x = ((double)b.MinX + b.MaxX) / 2, y = ((double)b.MinY + b.MaxY) / 2;
+			minX = std::min(minX, x);
+			minY = std::min(minY, y);
+			maxX = std::max(maxX, x);
+			maxY = std::max(maxY, y);
+			order.push_back(std::make_pair(0u, handle));
+		}
+
+		// sort the objects by the position of their center on a Hilbert curve that covers all of them
+		double scaleX = maxX > minX ? 65535 / (maxX - minX) : 0;
+		double scaleY = maxY > minY ? 65535 / (maxY - minY) : 0;
+		for (auto& item : order) {
+			Box b((*m_bodies)[item.second].Bounds);
+			double x = (((double)b.MinX + b.MaxX) / 2 - minX) * scaleX;
+			double y = (((double)b.MinY + b.MaxY) / 2 - minY) * scaleY;
+			item.first = hilbertIndex(x > 0 ? (uint32_t)std::min(x, 65535.0) : 0, y > 0 ? (uint32_t)std::min(y, 65535.0) : 0);
+		}
+		std::sort(order.begin(), order.end());
+
+		m_nodes.clear();
+		m_firstLeaf = 0;
+		if (order.empty()) {
+			m_dirty = false;
+			return;
+		}
+
+		// number of nodes on each level (leaves first) - the root is stored first and the leaves last
+		std::vector<size_t> levels(1, (order.size() + Width - 1) / Width);
+		while (levels.back() > 1)
+			levels.push_back((levels.back() + Width - 1) / Width);
+
+		size_t total = 0;
+		for (size_t count : levels)
+			total += count;
+		COLLY_COUNT_GROWTH(m_nodes);
+		m_nodes.resize(total);
+
+		const float inf = std::numeric_limits<float>::infinity();
+		auto setChild = [&](Node& n, int i, const Box& b, uint32_t categories, unsigned int child) {
+			n.MinX[i] = b.MinX;
+			n.MinY[i] = b.MinY;
+			n.MaxX[i] = b.MaxX;
+			n.MaxY[i] = b.MaxY;
+			n.Categories[i] = categories;
+			n.Child[i] = child;
+		};
+
+		// pack the sorted objects into the leaves
+		size_t first = total - levels[0];
+		m_firstLeaf = (unsigned int)first;
+		for (size_t i = 0; i < levels[0] * Width; i++) {
+			Node& n = m_nodes[first + i / Width];
+			if (i < order.size()) {
+				const Body& bdy = (*m_bodies)[order[i].second];
+				setChild(n, i % Width, Box(bdy.Bounds), bdy.Category, order[i].second);
+			} else
+				setChild(n, i % Width, Box(inf, inf, -inf, -inf), 0, None);
+		}
+
+		// and then the nodes of each level into the level above it
+		for (size_t level = 1; level < levels.size(); level++) {
+			size_t below = first;
+			first -= levels[level];
+			for (size_t i = 0; i < levels[level] * Width; i++) {
+				Node& n = m_nodes[first + i / Width];
+				if (i >= levels[level - 1]) {
+					setChild(n, i % Width, Box(inf, inf, -inf, -inf), 0, None);
+					continue;
+				}
+
+				const Node& child = m_nodes[below + i];
+				Box b(inf, inf, -inf, -inf);
+				uint32_t categories = 0;
+				for (int j = 0; j < Width; j++) {
+					b.MinX = std::min(b.MinX, child.MinX[j]);
+					b.MinY = std::min(b.MinY, child.MinY[j]);
+					b.MaxX = std::max(b.MaxX, child.MaxX[j]);
+					b.MaxY = std::max(b.MaxY, child.MaxY[j]);
+					categories |= child.Categories[j];
+				}
+				setChild(n, i % Width, b, categories, (unsigned int)(below + i));
+			}
+		}
+
+		m_dirty = false;
+	}
+	template<typename Visit>
+	void PackedTree::m_visit(const Box& bnd, uint32_t layers, Visit visit) const
+	{
+		m_flush();
+
+		// a box with no area doesnt overlap anything (this also lets us skip the area check for the objects
+		// in the leaves - objects with no area arent stored in the tree)
+		if (m_nodes.empty() || !(bnd.MinX < bnd.MaxX && bnd.MinY < bnd.MaxY))
+			return;
+
+		// nodes we still have to look at - enough for a tree with 32 levels
+		unsigned int stack[32 * Width];
+		size_t count = 0;
+		stack[count++] = 0;
+
+		while (count > 0) {
+			unsigned int node = stack[--count];
+			const Node& n = m_nodes[node];
+			COLLY_STAT(NodesVisited, 1);
+
+			// test all the children at once (no branches, so the compiler can use SIMD instructions)
+			unsigned int mask = 0;
+			for (int i = 0; i < Width; i++)
+				mask |= (unsigned int)((n.MinX[i] < bnd.MaxX) & (bnd.MinX < n.MaxX[i]) & (n.MinY[i] < bnd.MaxY) & (bnd.MinY < n.MaxY[i]) & ((n.Categories[i] & layers) != 0)) << i;
+
+			bool leaf = node >= m_firstLeaf;
+			while (mask != 0) {
+				int i = countTrailingZeros(mask);
+				mask &= mask - 1;
+
+				if (leaf)
+					visit(n.Child[i], (size_t)(node - m_firstLeaf) * Width + i);
+				else
+					stack[count++] = n.Child[i];
+			}
+		}
+	}
+
+
+
+	ThreadPool::ThreadPool(unsigned int threads)
+	{
+		if (threads == 0)
+			threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+		m_threadCount = threads;
+		m_queues.reset(new Queue[threads]);
+		for (unsigned int i = 0; i < threads; i++)
+			m_queues[i].Begin = m_queues[i].End = 0;
+
+		m_task = nullptr;
+		m_generation = 0;
+		m_busy = 0;
+		m_quit = false;
+
+		// the calling thread is thread 0
+		for (unsigned int i = 1; i < threads; i++)
+			m_threads.push_back(std::thread(&ThreadPool::m_loop, this, i));
+	}
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+
+		for (std::thread& thread : m_threads)
+			thread.join();
+	}
+	void ThreadPool::Run(size_t count, const std::function<void(size_t, unsigned int)>& task)
+	{
+		if (count == 0)
+			return;
+
+		// give each thread an equal part of the tasks
+		for (unsigned int i = 0; i < m_threadCount; i++) {
+			std::lock_guard<std::mutex> lock(m_queues[i].Lock);
+			m_queues[i].Begin = count * i / m_threadCount;
+			m_queues[i].End = count * (i + 1) / m_threadCount;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_task = &task;
+			m_busy = m_threadCount - 1;
+			m_generation++;
+		}
+		m_wake.notify_all();
+
+		m_work(0);
+
+		// wait for the other threads to finish their tasks
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_done.wait(lock, [&]() { return m_busy == 0; });
+		m_task = nullptr;
+	}
+	void ThreadPool::m_loop(unsigned int thread)
+	{
+		size_t generation = 0;
+
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_wake.wait(lock, [&]() { return m_quit || m_generation != generation; });
+				if (m_quit)
+					return;
+				generation = m_generation;
+			}
+
+			m_work(thread);
+
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_busy--;
+				if (m_busy == 0)
+					m_done.notify_one();
+			}
+		}
+	}
+	void ThreadPool::m_work(unsigned int thread)
+	{
+		size_t task;
+		while (m_pop(thread, task) || m_steal(thread, task))
+			(*m_task)(task, thread);
+	}
+	bool ThreadPool::m_pop(unsigned int thread, size_t& task)
+	{
+		Queue& queue = m_queues[thread];
+		std::lock_guard<std::mutex> lock(queue.Lock);
+
+		if (queue.Begin == queue.End)
+			return false;
+
+		task = queue.Begin++;
+		return true;
+	}
+	bool ThreadPool::m_steal(unsigned int thread, size_t& task)
+	{
+		for (unsigned int i = 1; i < m_threadCount; i++) {
+			Queue& victim = m_queues[(thread + i) % m_threadCount];
+			size_t begin, end;
+
+			// take the second half of the victim's tasks
+			{
+				std::lock_guard<std::mutex> lock(victim.Lock);
+				if (victim.Begin == victim.End)
+					continue;
+
+				begin = victim.Begin + (victim.End - victim.Begin) / 2;
+				end = victim.End;
+				victim.End = begin;
+			}
+
+			// run the first one right away and keep the rest in our queue (where they can be stolen again)
+			Queue& queue = m_queues[thread];
+			std::lock_guard<std::mutex> lock(queue.Lock);
+			queue.Begin = begin + 1;
+			queue.End = end;
+
+			task = begin;
+			return true;
+		}
+
+		return false;
+	}
+
+
+
+	World::World(BroadPhaseType type) :
+		m_broadPhaseType(type), m_staticCount(0)
+	{
+		if (type == BroadPhaseType::SweepAndPrune)
+			m_broadPhase.reset(new SweepAndPrune(m_bodies));
+		else if (type == BroadPhaseType::SpatialHash)
+			m_broadPhase.reset(new SpatialHash(m_bodies));
+		else if (type == BroadPhaseType::PackedTree)
+			m_broadPhase.reset(new PackedTree(m_bodies));
+		else
+			m_broadPhase.reset(new QuadTree(m_bodies));
+
+		m_staticTree.reset(new PackedTree(m_bodies));
+	}
+	void World::MoveObject(BodyHandle handle, const Rect& bounds)
+	{
+		Rect oldBounds = m_bodies[handle].Bounds;
+		m_bodies[handle].Bounds = bounds;
+		if (m_static[handle])
+			m_staticTree->Move(handle, oldBounds);
+		else
+			m_broadPhase->Move(handle, oldBounds);
+	}
+	void World::RemoveObject(BodyHandle handle)
+	{
+		// removing the same object twice would free its handle twice
+		if (!IsAlive(handle))
+			return;
+
+		m_removeId(handle);
+		if (m_static[handle]) {
+			m_staticTree->Remove(handle);
+			m_staticCount--;
+		} else
+			m_broadPhase->Remove(handle);
+
+		// leave a body that cant collide with anything in its place so that other handles stay valid
+		m_bodies[handle].Type = CollisionType::None;
+		m_bodies[handle].UserData = nullptr;
+		m_alive[handle] = false;
+		m_static[handle] = false;
+		m_generations[handle]++;
+		m_freeHandles.push_back(handle);
+	}
+	void World::SetObjectLayers(BodyHandle handle, uint32_t category, uint32_t mask)
+	{
+		// the trees keep the layers of the objects in their nodes, so the object has to be inserted again
+		if (m_static[handle]) {
+			m_bodies[handle].Category = category;
+			m_bodies[handle].Mask = mask;
+			m_staticTree->Move(handle, m_bodies[handle].Bounds);
+		} else {
+			m_broadPhase->Remove(handle);
+			m_bodies[handle].Category = category;
+			m_bodies[handle].Mask = mask;
+			m_broadPhase->Insert(handle);
+		}
+	}
+	void World::SetObjectId(BodyHandle handle, int id)
+	{
+		m_removeId(handle);
+		m_bodies[handle].Id = id;
+		m_addId(handle);
+	}
+	void World::UpdateQuadTree()
+	{
+		COLLY_PROFILE_SCOPE("World::UpdateQuadTree");
+
+		// the static tree can still have the bodies that were removed from the end of GetObjects()
+		if (m_syncBodies())
+			m_buildStaticTree();
+
+		m_buildBroadPhase();
+		m_buildIds();
+	}
+	void World::UpdateStaticTree()
+	{
+		COLLY_PROFILE_SCOPE("World::UpdateStaticTree");
+		if (m_syncBodies()) {
+			m_buildBroadPhase();
+			m_buildIds();
+		}
+
+		m_buildStaticTree();
+	}
+	bool World::Save(const std::string& filename) const
+	{
+		std::vector<BodyRecord> records(m_bodies.size());
+		std::vector<LayerRecord> layers(m_bodies.size());
+		std::vector<unsigned char> alive(m_bodies.size()), isStatic(m_bodies.size());
+		for (size_t i = 0; i < m_bodies.size(); i++) {
+			const Body& b = m_bodies[i];
+			records[i] = { b.Id, b.Bounds.X, b.Bounds.Y, b.Bounds.Width, b.Bounds.Height, (int32_t)b.Type };
+			layers[i] = { b.Category, b.Mask };
+			alive[i] = m_alive[i];
+			isStatic[i] = m_static[i];
+		}
+
+		std::vector<unsigned char> index, staticIndex;
+		m_broadPhase->Save(index);
+		m_staticTree->Save(staticIndex);
+
+		std::vector<unsigned char> data;
+		writeArray(data, records.data(), records.size());
+		writeArray(data, alive.data(), alive.size());
+		writeArray(data, m_freeHandles.data(), m_freeHandles.size());
+		writeArray(data, index.data(), index.size());
+		writeArray(data, isStatic.data(), isStatic.size());
+		writeArray(data, staticIndex.data(), staticIndex.size());
+		writeArray(data, layers.data(), layers.size());
+
+		return writeFile(filename, worldFile, (uint32_t)m_broadPhaseType, data);
+	}
+	bool World::Load(const std::string& filename)
+	{
+		MappedFile file;
+		Reader reader;
+		uint32_t version, type;
+		if (!file.Open(filename) || !readFile(file, worldFile, version, type, reader))
+			return false;
+
+		const BodyRecord* records;
+		const unsigned char* alive;
+		const unsigned char* index;
+		const unsigned char* isStatic = nullptr;
+		const unsigned char* staticIndex = nullptr;
+		const LayerRecord* layers = nullptr;
+		size_t bodyCount, aliveCount, indexSize, staticCount = 0, staticIndexSize = 0, layerCount = 0;
+		std::vector<BodyHandle> freeHandles;
+		if (!reader.View(records, bodyCount) || !reader.View(alive, aliveCount) || !reader.ReadArray(freeHandles) ||
+			!reader.View(index, indexSize) || aliveCount != bodyCount)
+			return false;
+
+		// files saved before static objects were added dont have them
+		if (version >= 2 && (!reader.View(isStatic, staticCount) || !reader.View(staticIndex, staticIndexSize) || staticCount != bodyCount))
+			return false;
+
+		// files saved before the collision layers were added dont have them
+		if (version >= 3 && (!reader.View(layers, layerCount) || layerCount != bodyCount))
+			return false;
+
+		// a handle that is free twice would be given to two objects
+		std::vector<bool> isFree(bodyCount, false);
+		for (BodyHandle handle : freeHandles) {
+			if (handle >= bodyCount || alive[handle] || isFree[handle])
+				return false;
+			isFree[handle] = true;
+		}
+		for (size_t i = 0; i < bodyCount; i++)
+			if (records[i].Type < (int32_t)CollisionType::None || records[i].Type > (int32_t)CollisionType::Cross)
+				return false;
+
+		// handles that were in use before are now used by the loaded objects, so the old references cant be valid
+		for (unsigned int& generation : m_generations)
+			generation++;
+		if (m_generations.size() < bodyCount)
+			m_generations.resize(bodyCount, 0);
+
+		m_bodies.resize(bodyCount);
+		m_alive.resize(bodyCount);
+		m_static.resize(bodyCount);
+		for (size_t i = 0; i < bodyCount; i++) {
+			const BodyRecord& r = records[i];
+			m_bodies[i].Id = r.Id;
+			m_bodies[i].Bounds = Rect(r.X, r.Y, r.Width, r.Height);
+			m_bodies[i].Type = (CollisionType)r.Type;
+			m_bodies[i].UserData = nullptr;
+			m_bodies[i].Category = layers != nullptr ? layers[i].Category : DefaultCategory;
+			m_bodies[i].Mask = layers != nullptr ? layers[i].Mask : AllCategories;
+			m_alive[i] = alive[i] != 0;
+			m_static[i] = m_alive[i] && isStatic != nullptr && isStatic[i] != 0;
+		}
+		m_freeHandles.swap(freeHandles);
+
+		// use the saved indices if they were saved by the same broad phase, otherwise build them (the nodes
+		// of the trees saved before version 3 dont have the layers)
+		if (version < 3 || type != (uint32_t)m_broadPhaseType || !m_broadPhase->Load(index, indexSize))
+			UpdateQuadTree();
+		else
+			m_buildIds();
+		if (version < 3 || !m_staticTree->Load(staticIndex, staticIndexSize))
+			UpdateStaticTree();
+		else
+			m_staticCount = std::count(m_static.begin(), m_static.end(), true);
+
+		return true;
+	}
+	void World::Clear()
+	{
+		for (unsigned int& generation : m_generations)
+			generation++;
+
+		m_bodies.clear();
+		m_alive.clear();
+		m_static.clear();
+		m_freeHandles.clear();
+		UpdateQuadTree();
+		UpdateStaticTree();
+	}
+	std::vector<Body*> World::GetObjects(int id)
+	{
+		std::vector<Body*> ret;
+		auto list = m_ids.find(id);
+		if (list == m_ids.end())
+			return ret;
+
+		// skip the objects whose id was changed through GetObjects() after they were added to the list
+		for (BodyHandle handle : list->second)
+			if (m_bodies[handle].Id == id)
+				ret.push_back(&m_bodies[handle]);
 
+		// removing objects shuffles the list, so sort them by their handle (the bodies are stored in that order)
+		std::sort(ret.begin(), ret.end());
+		return ret;
+	}
+	void World::RemoveObjects(int id)
+	{
+		auto list = m_ids.find(id);
+		if (list == m_ids.end())
+			return;
 
-		// If the intersection is valid (positive non zero area), then there is an intersection
-		if (interLeft < interRight && interTop < interBottom) {
-			intersection = Rect(interLeft, interTop, interRight - interLeft, interBottom - interTop);
-			return true;
-		}
+		// RemoveObject changes the list, so go through a sorted copy of it (the handles are freed in the same order as
+		// if we went through all the objects)
+		std::vector<BodyHandle> handles = list->second;
+		std::sort(handles.begin(), handles.end());
+		for (BodyHandle handle : handles)
+			if (m_bodies[handle].Id == id)
+				RemoveObject(handle);
+	}
+	Point World::Check(int steps, Rect bounds, Point goal, std::function<void(Body&, World*)> func)
+	{
+		if (func == nullptr)
+			return Check(steps, bounds, goal, NoCallback());
 
-		intersection = Rect(0, 0, 0, 0);
-		return false;
+		return Check(steps, bounds, goal, [&](Body& body, World* world) {
+			func(body, world);
+		});
 	}
+	Point World::Check(int steps, const Body& body, Point goal, std::function<void(Body&, World*)> func)
+	{
+		if (func == nullptr)
+			return Check(steps, body, goal, NoCallback());
 
+		return Check(steps, body, goal, [&](Body& hit, World* world) {
+			func(hit, world);
+		});
+	}
+	bool World::Raycast(Point from, Point to, RaycastHit& hit, CollisionType type, uint32_t mask) const
+	{
+		COLLY_PROFILE_SCOPE("World::Raycast");
+
+		// static objects first - they are usually the walls that block the ray, so we dont have to look that far in the other tree
+		ClosestRayHit visitor(m_bodies, from, to, type, mask, hit);
+		if (m_staticCount > 0)
+			m_staticTree->Raycast(from, to.X - from.X, to.Y - from.Y, 1, visitor);
+		m_broadPhase->Raycast(from, to.X - from.X, to.Y - from.Y, visitor.GetLimit(), visitor);
+		return visitor.Found;
+	}
+	void World::RaycastAll(Point from, Point to, std::vector<RaycastHit>& hits, CollisionType type, uint32_t mask) const
+	{
+		COLLY_PROFILE_SCOPE("World::RaycastAll");
+		hits.clear();
 
+		AllRayHits visitor(m_bodies, from, to, type, mask, hits);
+		if (m_staticCount > 0)
+			m_staticTree->Raycast(from, to.X - from.X, to.Y - from.Y, 1, visitor);
+		m_broadPhase->Raycast(from, to.X - from.X, to.Y - from.Y, 1, visitor);
 
-	QuadTree::QuadTree(const Rect& bnds)
+		std::sort(hits.begin(), hits.end(), [](const RaycastHit& a, const RaycastHit& b) {
+			return a.Fraction < b.Fraction || (a.Fraction == b.Fraction && a.Handle < b.Handle);
+		});
+	}
+	Point World::Sweep(Rect bounds, Point goal, std::function<void(Body&, World*)> func)
 	{
-		m_bounds = bnds;
-		m_capacity = 0;
-		m_topLeft = nullptr;
-		m_topRight = nullptr;
-		m_bottomLeft = nullptr;
-		m_bottomRight = nullptr;
+		return m_sweep(bounds, AllCategories, AllCategories, goal, func);
 	}
-	QuadTree::~QuadTree()
+	Point World::Sweep(const Body& body, Point goal, std::function<void(Body&, World*)> func)
 	{
-		delete m_topLeft;
-		delete m_topRight;
-		delete m_bottomLeft;
-		delete m_bottomRight;
+		return m_sweep(body.Bounds, body.Category, body.Mask, goal, func);
 	}
-	void QuadTree::Reset(const Rect & bnds)
+	Point World::m_sweep(Rect bounds, uint32_t category, uint32_t mask, Point goal, const std::function<void(Body&, World*)>& func)
 	{
-		m_bounds = bnds;
-		m_capacity = 0;
+		COLLY_PROFILE_SCOPE("World::Sweep");
 
-		if (m_topLeft != nullptr) {
-			delete m_topLeft;
-			delete m_topRight;
-			delete m_bottomLeft;
-			delete m_bottomRight;
-			m_topLeft = nullptr;
-			m_topRight = nullptr;
-			m_bottomLeft = nullptr;
-			m_bottomRight = nullptr;
+		// the body stays inside of the box that covers its start and end position
+		Box start(bounds);
+		float dx = goal.X - bounds.X, dy = goal.Y - bounds.Y;
+		Box area(std::min(start.MinX, start.MinX + dx), std::min(start.MinY, start.MinY + dy),
+			std::max(start.MaxX, start.MaxX + dx), std::max(start.MaxY, start.MaxY + dy));
+
+		std::vector<BodyHandle> bodies;
+		{
+			COLLY_COUNT_GROWTH(bodies);
+			m_query(area, mask, bodies);
+			bodies.erase(std::remove_if(bodies.begin(), bodies.end(), [&](BodyHandle handle) {
+				return (m_bodies[handle].Mask & category) == 0;
+			}), bodies.end());
+			std::sort(bodies.begin(), bodies.end());
 		}
+
+		return sweep<BodyHandle>(bounds, goal, [&](SweepState<BodyHandle>& state) {
+			for (BodyHandle handle : bodies)
+				state.Add(handle, Box(m_bodies[handle].Bounds), m_bodies[handle].Type);
+		}, [&](BodyHandle handle, int /*axis*/) {
+			if (func != nullptr) {
+				COLLY_STAT(CallbackInvocations, 1);
+				func(m_bodies[handle], this);
+			}
+		});
 	}
-	void QuadTree::Insert(const Body& bdy)
+	void World::CheckMany(int steps, const Rect* bodies, const Point* goals, Point* results, size_t count, std::function<void(size_t, Body&, World*)> func)
 	{
-		Rect intersectRect; // not used
+		COLLY_PROFILE_SCOPE("World::CheckMany");
+		m_prepareBatch(bodies, goals, count);
 
-		if (!m_bounds.Intersects(bdy.Bounds, intersectRect))
-			return;
+		if (m_batchScratch.empty())
+			m_batchScratch.resize(1);
 
-		// do we have enough space? if yes, just add it to this node
-		if (m_capacity < QuadTree::Capacity) {
-			m_add(bdy);
-			return;
+		for (size_t group = 0; group < m_batchGroups.size(); group++) {
+			m_checkGroup(group, steps, bodies, goals, results, m_batchScratch[0], func != nullptr, [&](size_t index, BodyHandle handle) {
+				if (func != nullptr) {
+					COLLY_STAT(CallbackInvocations, 1);
+					func(index, m_bodies[handle], this);
+				}
+			});
 		}
-
-		// subdivide if we havent already
-		if (m_topLeft == nullptr)
-			m_subdivide();
-
-		// insert into all regions that intersect with the rectangle
-		m_topLeft->Insert(bdy);
-		m_topRight->Insert(bdy);
-		m_bottomLeft->Insert(bdy);
-		m_bottomRight->Insert(bdy);
 	}
-	void QuadTree::Query(const Rect& bnd, std::vector<Body>& elements)
+	void World::CheckMany(ThreadPool& pool, int steps, const Rect* bodies, const Point* goals, Point* results, size_t count, std::function<void(size_t, Body&, World*)> func)
 	{
-		Rect intersectRect; // not used
+		COLLY_PROFILE_SCOPE("World::CheckMany");
+		m_prepareBatch(bodies, goals, count);
+
+		if (m_batchScratch.size() < pool.GetThreadCount())
+			m_batchScratch.resize(pool.GetThreadCount());
+		for (BatchScratch& scratch : m_batchScratch)
+			scratch.Events.clear();
+		m_batchEvents.resize(count);
+
+		pool.Run(m_batchGroups.size(), [&](size_t group, unsigned int thread) {
+			BatchScratch& scratch = m_batchScratch[thread];
+
+			// the objects of a group are checked one after another on the same thread, so the
+			// hits of each object end up next to each other in the thread's list
+			for (size_t i = m_batchGroups[group].Begin; i < m_batchGroups[group].End; i++) {
+				BatchEvents& events = m_batchEvents[m_batchOrder[i].second];
+				events.Thread = thread;
+				events.First = 0;
+				events.Count = 0;
+			}
 
-		// check if our bounds intersect with the quad tree node
-		if (!m_bounds.Intersects(bnd, intersectRect))
+			// the function is called later, so the bodies cant change while we are checking them
+			m_checkGroup(group, steps, bodies, goals, results, scratch, false, [&](size_t index, BodyHandle handle) {
+				if (func == nullptr)
+					return;
+
+				BatchEvents& events = m_batchEvents[index];
+				if (events.Count == 0)
+					events.First = scratch.Events.size();
+				events.Count++;
+
+				scratch.Events.push_back(handle);
+			});
+		});
+
+		// call the user function in a fixed order
+		if (func != nullptr) {
+			COLLY_PROFILE_SCOPE("World::CheckMany/Callbacks");
+			for (size_t index = 0; index < count; index++) {
+				const BatchEvents& events = m_batchEvents[index];
+				const std::vector<BodyHandle>& hits = m_batchScratch[events.Thread].Events;
+				COLLY_STAT(CallbackInvocations, events.Count);
+				for (size_t i = 0; i < events.Count; i++)
+					func(index, m_bodies[hits[events.First + i]], this);
+			}
+		}
+	}
+	void World::m_prepareBatch(const Rect* bodies, const Point* goals, size_t count)
+	{
+		m_batchGroups.clear();
+		if (count == 0)
 			return;
 
-		// get all elements in this node and check if they intersect with our bounds
-		for (int i = 0; i < m_capacity; i++) {
-			if (m_elements[i].Type != CollisionType::None &&
-				m_elements[i].Bounds.Intersects(bnd, intersectRect)) {
+		// calculate the check regions and the area they cover
+		m_batchRegions.resize(count);
+		m_batchOrder.resize(count);
 
-				bool unique = true;
-				for (int j = 0; j < elements.size(); j++)
-					if (elements[j] == m_elements[i]) {
-						unique = false;
-						break;
-					}
+		Box extent(Rect(bodies[0].X, bodies[0].Y, 0, 0));
+		for (size_t i = 0; i < count; i++) {
+			Box& region = m_batchRegions[i];
+			region = Box(m_checkRegion(bodies[i], goals[i]));
 
-				if (unique) elements.push_back(m_elements[i]);
-			}
+			extent.MinX = std::min(extent.MinX, region.MinX);
+			extent.MinY = std::min(extent.MinY, region.MinY);
+			extent.MaxX = std::max(extent.MaxX, region.MaxX);
+			extent.MaxY = std::max(extent.MaxY, region.MaxY);
 		}
 
-		// just exit if we have no leaves
-		if (m_topLeft == nullptr)
-			return;
+		// sort the objects along a Z-order curve so that the objects next to each other in the list are also close in the world
+		float scaleX = 65535.0f / std::max(extent.MaxX - extent.MinX, 1.0f);
+		float scaleY = 65535.0f / std::max(extent.MaxY - extent.MinY, 1.0f);
+		for (size_t i = 0; i < count; i++) {
+			const Box& region = m_batchRegions[i];
+			unsigned int x = (unsigned int)(((region.MinX + region.MaxX) / 2 - extent.MinX) * scaleX);
+			unsigned int y = (unsigned int)(((region.MinY + region.MaxY) / 2 - extent.MinY) * scaleY);
 
-		// query all the regions
-		m_topLeft->Query(bnd, elements);
-		m_topRight->Query(bnd, elements);
-		m_bottomLeft->Query(bnd, elements);
-		m_bottomRight->Query(bnd, elements);
+			// interleave the bits of the two coordinates
+			unsigned int code = 0;
+			for (unsigned int bit = 0; bit < 16; bit++)
+				code |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+
+			m_batchOrder[i] = std::make_pair(code, i);
+		}
+		std::sort(m_batchOrder.begin(), m_batchOrder.end());
+
+		size_t start = 0;
+		while (start < count) {
+			// keep adding neighbours to the group while the shared region doesnt get much bigger than the regions themselves
+			Box group = m_batchRegions[m_batchOrder[start].second];
+			float area = (group.MaxX - group.MinX) * (group.MaxY - group.MinY);
+			size_t end = start + 1;
+			for (; end < count && end - start < BatchGroupSize; end++) {
+				const Box& region = m_batchRegions[m_batchOrder[end].second];
+				Box merged(std::min(group.MinX, region.MinX), std::min(group.MinY, region.MinY),
+					std::max(group.MaxX, region.MaxX), std::max(group.MaxY, region.MaxY));
+
+				float regionArea = (region.MaxX - region.MinX) * (region.MaxY - region.MinY);
+				if ((merged.MaxX - merged.MinX) * (merged.MaxY - merged.MinY) > 2 * (area + regionArea))
+					break;
+
+				group = merged;
+				area += regionArea;
+			}
+
+			BatchGroup batch;
+			batch.Begin = start;
+			batch.End = end;
+			batch.Bounds = group;
+			m_batchGroups.push_back(batch);
+			start = end;
+		}
 	}
-	void QuadTree::m_subdivide()
+	template<typename Callback>
+	void World::m_checkGroup(size_t group, int steps, const Rect* bodies, const Point* goals, Point* results, BatchScratch& scratch, bool refresh, Callback onHit)
 	{
-		m_topLeft = new QuadTree(Rect(m_bounds.X, m_bounds.Y, m_bounds.Width / 2, m_bounds.Height / 2));
-		m_topRight = new QuadTree(Rect(m_bounds.X + m_bounds.Width / 2, m_bounds.Y, m_bounds.Width / 2, m_bounds.Height / 2));
-		m_bottomLeft = new QuadTree(Rect(m_bounds.X, m_bounds.Y + m_bounds.Height / 2, m_bounds.Width / 2, m_bounds.Height / 2));
-		m_bottomRight = new QuadTree(Rect(m_bounds.X + m_bounds.Width / 2, m_bounds.Y + m_bounds.Height / 2, m_bounds.Width / 2, m_bounds.Height / 2));
+		const BatchGroup& batch = m_batchGroups[group];
+
+		// one query for the whole group
+		scratch.Group.clear();
+		{
+			COLLY_COUNT_GROWTH(scratch.Group);
+			m_query(batch.Bounds, AllCategories, scratch.Group);
+			std::sort(scratch.Group.begin(), scratch.Group.end());
+		}
+
+		for (size_t i = batch.Begin; i < batch.End; i++) {
+			size_t index = m_batchOrder[i].second;
+			const Box& region = m_batchRegions[index];
+
+			// pick the bodies that this object's own query would return (the objects are in all the layers)
+			COLLY_STAT(IntersectionTests, scratch.Group.size());
+			COLLY_COUNT_GROWTH(scratch.Candidates);
+			scratch.Candidates.clear();
+			for (BodyHandle handle : scratch.Group)
+				if (m_bodies[handle].Mask != 0 && Box(m_bodies[handle].Bounds).Overlaps(region))
+					scratch.Candidates.push_back(handle);
+
+			results[index] = m_resolve(steps, bodies[index], goals[index], scratch.Candidates, refresh, [&](BodyHandle handle) {
+				onHit(index, handle);
+			});
+		}
 	}
-	void QuadTree::m_add(const Body& element)
+	void World::FindOverlappingPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB)
 	{
-		m_elements[m_capacity] = element;
-		m_capacity++;
-	}
+		COLLY_PROFILE_SCOPE("World::FindOverlappingPairs");
+		m_broadPhase->FindPairs(pairs, typeA, typeB);
+		if (m_staticCount == 0 || typeA == CollisionType::None || typeB == CollisionType::None)
+			return;
 
+		m_staticTree->FindPairs(pairs, typeA, typeB);
 
+		// pairs of a static object and an object that isnt static - found by querying the static tree
+		// with every other object, so each pair is found once
+		std::vector<BodyHandle> found;
+		for (BodyHandle i = 0; i < m_bodies.size(); i++) {
+			const Body& b = m_bodies[i];
+			if (!m_alive[i] || m_static[i] || (b.Type != typeA && b.Type != typeB))
+				continue;
 
-	World::World() :
-		m_tree(Rect())
-	{}
-	void World::UpdateQuadTree()
+			found.clear();
+			m_staticTree->Query(Box(b.Bounds), found, b.Mask);
+			for (BodyHandle other : found) {
+				if (!b.CollidesWith(m_bodies[other]))
+					continue;
+
+				CollisionType otherType = m_bodies[other].Type;
+				if (b.Type == typeA && otherType == typeB)
+					pairs.push_back(typeA == typeB ? BodyPair{ std::min(i, other), std::max(i, other) } : BodyPair{ i, other });
+				else if (b.Type == typeB && otherType == typeA)
+					pairs.push_back({ other, i });
+			}
+		}
+	}
+	void World::m_checkCandidates(const Rect& bounds, uint32_t category, uint32_t mask, Point goal, std::vector<BodyHandle>& bodies) const
 	{
-		m_tree.Reset(m_getBounds());
-		for (const Body& b : m_bodies)
-			m_tree.Insert(b);
+		COLLY_PROFILE_SCOPE("World::Check/Query");
+		COLLY_COUNT_GROWTH(bodies);
+		m_query(Box(m_checkRegion(bounds, goal)), mask, bodies);
+
+		// the trees only skip the bodies that arent in our mask - drop the ones that dont collide with our category too
+		bodies.erase(std::remove_if(bodies.begin(), bodies.end(), [&](BodyHandle handle) {
+			return (m_bodies[handle].Mask & category) == 0;
+		}), bodies.end());
+		std::sort(bodies.begin(), bodies.end());
 	}
-	void World::Clear()
+	World::CandidateList::CandidateList() : Bodies(acquireCandidateList()) { }
+	World::CandidateList::~CandidateList()
 	{
-		m_bodies.clear();
-		UpdateQuadTree();
+		candidatePool.Depth--;
 	}
-	std::vector<Body*> World::GetObjects(int id)
+	void World::m_fillCandidates(const std::vector<BodyHandle>& bodies) const
 	{
-		std::vector<Body*> ret;
-		for (int i = 0; i < m_bodies.size(); i++)
-			if (m_bodies[i].Id == id)
-				ret.push_back(&m_bodies[i]);
-		return ret;
+		candidateBoxes.Fill(m_bodies, bodies);
 	}
-	void World::RemoveObjects(int id)
+	unsigned int World::m_candidateMask(size_t first, const Box& mover) const
 	{
-		for (int i = 0; i < m_bodies.size(); i++)
-			if (m_bodies[i].Id == id)
-				m_bodies.erase(m_bodies.begin() + i);
+		static_assert(CandidateWidth == CandidateBoxes::Width, "World and CandidateBoxes must test the same number of candidates at once");
+		return overlapMask(candidateBoxes, first, mover);
 	}
-	Point World::Check(int steps, Rect bounds, Point goal, std::function<void(Body&, World*)> func)
+	Rect World::m_checkRegion(const Rect& bounds, Point goal) const
 	{
-		Rect intersect;
-
-		// the increment per axis for each step
-		float xInc = (goal.X - bounds.X) / steps;
-		float yInc = (goal.Y - bounds.Y) / steps;
-
-		// calculate quadtree region
 		Rect checkRegion(std::min(goal.X, bounds.X), std::min(goal.Y, bounds.Y), std::max(goal.X, bounds.X + bounds.Width), std::max(goal.Y, bounds.Y + bounds.Height));
 		checkRegion.X -= bounds.Width;
 		checkRegion.Y -= bounds.Height;
 		checkRegion.Width = (checkRegion.Width + bounds.Width) - checkRegion.X;
 		checkRegion.Height = (checkRegion.Height + bounds.Height) - checkRegion.Y;
+		return checkRegion;
+	}
+	BodyHandle World::m_add(const Body& body, bool isStatic)
+	{
+		// the new handle has to be the position of the body in m_bodies, so take care of pushed/removed bodies first
+		if (m_syncBodies()) {
+			m_buildBroadPhase();
+			m_buildStaticTree();
+			m_buildIds();
+		}
+
+		BodyHandle handle;
+
+		// reuse the handle of some removed body if we can
+		if (!m_freeHandles.empty()) {
+			handle = m_freeHandles.back();
+			m_freeHandles.pop_back();
+			m_bodies[handle] = body;
+			m_alive[handle] = true;
+			m_static[handle] = isStatic;
+		} else {
+			handle = (BodyHandle)m_bodies.size();
+			m_bodies.push_back(body);
+			m_alive.push_back(true);
+			m_static.push_back(isStatic);
+			m_idSlots.push_back(IdSlot());
+
+			// the handle might have been used before the world was cleared - keep counting from there
+			if (m_generations.size() <= handle)
+				m_generations.push_back(0);
+		}
+		m_addId(handle);
+
+		if (isStatic) {
+			m_staticTree->Insert(handle);
+			m_staticCount++;
+		} else
+			m_broadPhase->Insert(handle);
+
+		return handle;
+	}
+	bool World::m_syncBodies()
+	{
+		size_t count = m_bodies.size();
+		if (m_alive.size() < count) {
+			BodyHandle first = (BodyHandle)m_alive.size();
+			m_alive.resize(count, true);
+			m_static.resize(count, false);
+			m_idSlots.resize(count);
+			if (m_generations.size() < count)
+				m_generations.resize(count, 0);
+
+			for (BodyHandle i = first; i < count; i++) {
+				m_addId(i);
+				m_broadPhase->Insert(i);
+			}
+		} else if (m_alive.size() > count) {
+			// the removed bodies cant be taken out of the trees one by one (their bounds are gone), so the caller
+			// builds everything again - just make sure the old handles arent used anymore
+			for (size_t i = count; i < m_alive.size(); i++)
+				if (m_alive[i])
+					m_generations[i]++;
+			m_alive.resize(count);
+			m_static.resize(count);
+			m_idSlots.resize(count);
+			m_freeHandles.erase(std::remove_if(m_freeHandles.begin(), m_freeHandles.end(), [&](BodyHandle handle) {
+				return handle >= count;
+			}), m_freeHandles.end());
 
-		// get only the bodies we have to check collision with
-		std::vector<Body> bodies;
-		m_tree.Query(checkRegion, bodies);
+			return true;
+		}
+
+		return false;
+	}
+	void World::m_buildBroadPhase()
+	{
+		m_broadPhase->Reset(m_getBounds());
+		for (BodyHandle i = 0; i < m_bodies.size(); i++)
+			if (m_alive[i] && !m_static[i])
+				m_broadPhase->Insert(i);
+	}
+	void World::m_buildStaticTree()
+	{
+		m_staticCount = 0;
+		m_staticTree->Reset(Rect());
+		for (BodyHandle i = 0; i < m_bodies.size(); i++) {
+			if (m_alive[i] && m_static[i]) {
+				m_staticTree->Insert(i);
+				m_staticCount++;
+			}
+		}
+	}
+	void World::m_addId(BodyHandle handle)
+	{
+		std::vector<BodyHandle>& list = m_ids[m_bodies[handle].Id];
+		m_idSlots[handle].Id = m_bodies[handle].Id;
+		m_idSlots[handle].Position = (unsigned int)list.size();
+		list.push_back(handle);
+	}
+	void World::m_removeId(BodyHandle handle)
+	{
+		// the object might have got a different id through GetObjects(), so use the one it was added with
+		IdSlot slot = m_idSlots[handle];
+		auto list = m_ids.find(slot.Id);
+		if (list == m_ids.end())
+			return;
 
-		// go thru each step
-		for (int i = 0; i < steps; i++) {
-			// increment along x axis and check for collision
-			bounds.X += xInc;
-			for (Body b : bodies) {
-				if (b.Type == CollisionType::None) // no collision checking needed? just skip the body
+		// move the last handle in the list to the place of the removed one
+		BodyHandle last = list->second.back();
+		list->second[slot.Position] = last;
+		m_idSlots[last].Position = slot.Position;
+		list->second.pop_back();
+		if (list->second.empty())
+			m_ids.erase(list);
+	}
+	void World::m_buildIds()
+	{
+		m_ids.clear();
+		m_idSlots.resize(m_bodies.size());
+		for (BodyHandle i = 0; i < m_bodies.size(); i++)
+			if (m_alive[i])
+				m_addId(i);
+	}
+	Rect World::m_getBounds() const
+	{
+		// if there are any elements in this world, get the min and max positions
+		size_t first = 0;
+		while (first < m_bodies.size() && (!m_alive[first] || m_static[first]))
+			first++;
+
+		if (first < m_bodies.size()) {
+			Rect ret(m_bodies[first].Bounds.X, m_bodies[first].Bounds.Y, m_bodies[first].Bounds.X, m_bodies[first].Bounds.Y);
+			for (size_t i = first; i < m_bodies.size(); i++) {
+				if (!m_alive[i] || m_static[i])
 					continue;
 
-				// does our bound intersect with the body
-				if (b.Bounds.Intersects(bounds, intersect)) {
-					// call the user function
-					if (func != nullptr)
-						func(b, this);
+				const Body& b = m_bodies[i];
+				ret.X = std::min(b.Bounds.X, ret.X);
+				ret.Y = std::min(b.Bounds.Y, ret.Y);
+				ret.Width = std::max(b.Bounds.X + b.Bounds.Width, ret.Width);
+				ret.Height = std::max(b.Bounds.Y + b.Bounds.Height, ret.Height);
+			}
 
-					// only check for collision if we encountered a solid object
-					if (b.Type != CollisionType::Solid)
-						continue;
+			return Rect(ret.X, ret.Y, ret.Width - ret.X, ret.Height - ret.Y);
+		}
 
-					float xInter = intersect.Width;
-					float yInter = intersect.Height;
+		// else return 0px region
+		return Rect(0, 0, 0, 0);
+	}
+	void World::m_query(const Box& bnd, uint32_t mask, std::vector<BodyHandle>& bodies) const
+	{
+		m_broadPhase->Query(bnd, bodies, mask);
+		if (m_staticCount > 0)
+			m_staticTree->Query(bnd, bodies, mask);
+	}
 
-					if (xInter < yInter) {
-						if (bounds.X < b.Bounds.X)
-							xInter *= -1; // bounce in the direction that depends on the body and user position
 
-						bounds.X += xInter; // move the user back
 
-						break;
-					}
-				}
-			}
+	template<typename TileType>
+	constexpr unsigned int BasicGridWorld<TileType>::MaxTableSize;
 
-			// increment along y axis and check for collision - repeat everything for Y axis
-			bounds.Y += yInc;
-			for (Body b : bodies) {
-				if (b.Type == CollisionType::None)
-					continue;
+	template<typename TileType>
+	BasicGridWorld<TileType>::BasicGridWorld() :
+		m_w(0), m_h(0), m_cellW(1), m_cellH(1), m_tableSize(0), m_typesVersion(0), m_rowWords(0)
+	{}
+	template<typename TileType>
+	void BasicGridWorld<TileType>::Create(int width, int height, int cellW, int cellH)
+	{
+		m_cellH = cellH;
+		m_cellW = cellW;
+		m_w = width;
+		m_h = height;
 
-				if (b.Bounds.Intersects(bounds, intersect)) {
-					if (func != nullptr)
-						func(b, this);
+		// create the gird
+		m_tiles.assign((size_t)m_w * m_h, 0);
 
-					if (b.Type != CollisionType::Solid)
-						continue;
+		// default filter - ID == 0 -> no collision else sold object
+		GetCollisionType = [](int id) -> CollisionType
+		{
+			if (id == 0)
+				return CollisionType::None;
+			return CollisionType::Solid;
+		};
+		GetCollisionType.SetPure(true);
 
-					float xInter = intersect.Width;
-					float yInter = intersect.Height;
+		// narrow tiles can only hold so many IDs, so we can store the type of every one of them
+		m_buildTable(sizeof(TileType) <= 2 ? (size_t)1 << (8 * sizeof(TileType)) : 256);
+		m_buildMask();
+	}
+	template<typename TileType>
+	bool BasicGridWorld<TileType>::Save(const std::string& filename) const
+	{
+		std::vector<unsigned char> data;
+		writeValue(data, (int32_t)m_w);
+		writeValue(data, (int32_t)m_h);
+		writeValue(data, (int32_t)m_cellW);
+		writeValue(data, (int32_t)m_cellH);
+		writeArray(data, m_tiles.data(), m_tiles.size());
+
+		return writeFile(filename, gridFile, sizeof(TileType), data);
+	}
+	template<typename TileType>
+	bool BasicGridWorld<TileType>::Load(const std::string& filename)
+	{
+		MappedFile file;
+		Reader reader;
+		uint32_t version, tileSize;
+		if (!file.Open(filename) || !readFile(file, gridFile, version, tileSize, reader) || tileSize != sizeof(TileType))
+			return false;
+
+		int32_t width, height, cellW, cellH;
+		const TileType* tiles;
+		size_t count;
+		if (!reader.Read(width) || !reader.Read(height) || !reader.Read(cellW) || !reader.Read(cellH) || !reader.View(tiles, count))
+			return false;
+		if (width <= 0 || height <= 0 || cellW <= 0 || cellH <= 0 || count != (size_t)width * height)
+			return false;
+
+		Create(width, height, cellW, cellH);
+		m_tiles.assign(tiles, tiles + count);
+
+		// make the table big enough for all the IDs and fill the masks
+		if (!m_tiles.empty()) {
+			TileType maxTile = *std::max_element(m_tiles.begin(), m_tiles.end());
+			if ((unsigned int)maxTile >= m_tableSize)
+				m_growTable(maxTile);
+		}
+		m_buildMask();
 
-					if (yInter < xInter) {
-						if (bounds.Y < b.Bounds.Y)
-							yInter *= -1;
+		return true;
+	}
+	template<typename TileType>
+	Point BasicGridWorld<TileType>::Check(int steps, Rect bounds, Point goal, std::function<void(int, int, int, bool, BasicGridWorld*)> func)
+	{
+		if (func == nullptr)
+			return Check(steps, bounds, goal, NoCallback());
 
-						bounds.Y += yInter;
+		return Check(steps, bounds, goal, [&](int id, int x, int y, bool xAxis, BasicGridWorld* world) {
+			func(id, x, y, xAxis, world);
+		});
+	}
+	template<typename TileType>
+	Point BasicGridWorld<TileType>::Sweep(Rect bounds, Point goal, std::function<void(int, int, int, bool, BasicGridWorld*)> func)
+	{
+		COLLY_PROFILE_SCOPE("GridWorld::Sweep");
+		if (GetCollisionType.GetVersion() != m_typesVersion) {
+			m_buildTable(m_tableSize);
+			m_buildMask();
+		}
 
-						break;
-					}
+		// only visit the cells the body passes thru and stop once we are past the first solid tile we hit
+		return sweep<TileHit>(bounds, goal, [&](SweepState<TileHit>& state) {
+			traverseGrid(state.Mover, state.DX, state.DY, m_cellW, m_cellH, m_w, m_h, state.HitTime, [&](int x, int y) {
+				size_t index = (size_t)y * m_w + x;
+				if (m_mask[(size_t)y * m_rowWords + (x >> 6)] & (1ULL << (x & 63))) {
+					TileHit tile = { x, y, m_tiles[index] };
+					state.Add(tile, Box(Rect(x*m_cellW, y*m_cellH, m_cellW, m_cellH)), m_getType(tile.Id));
 				}
+			});
+		}, [&](const TileHit& tile, int axis) {
+			if (func != nullptr) {
+				COLLY_STAT(CallbackInvocations, 1);
+				func(tile.Id, tile.X, tile.Y, axis == 0, this);
 			}
+		});
+	}
+	template<typename TileType>
+	bool BasicGridWorld<TileType>::Raycast(Point from, Point to, GridRaycastHit& hit, CollisionType type)
+	{
+		COLLY_PROFILE_SCOPE("GridWorld::Raycast");
+		if (GetCollisionType.GetVersion() != m_typesVersion) {
+			m_buildTable(m_tableSize);
+			m_buildMask();
 		}
 
-		return { bounds.X, bounds.Y };
+		return raycastGrid(from, to, m_cellW, m_cellH, m_w, m_h, hit, [&](int x, int y, int& id) {
+			// the mask only knows which tiles arent CollisionType::None
+			if (type != CollisionType::None && !(m_mask[(size_t)y * m_rowWords + (x >> 6)] & (1ULL << (x & 63))))
+				return false;
+
+			id = m_tiles[(size_t)y * m_w + x];
+			return m_getType(id) == type;
+		});
 	}
-	Rect World::m_getBounds()
+	template<typename TileType>
+	void BasicGridWorld<TileType>::m_buildTable(size_t size)
 	{
-		// if there are any elements in this world, get the min and max positions
-		if (m_bodies.size() > 0) {
-			Rect ret(m_bodies[0].Bounds.X, m_bodies[0].Bounds.Y, m_bodies[0].Bounds.X, m_bodies[0].Bounds.Y);
-			for (const Body& b : m_bodies) {
-				ret.X = std::min(b.Bounds.X, ret.X);
-				ret.Y = std::min(b.Bounds.Y, ret.Y);
-				ret.Width = std::max(b.Bounds.X + b.Bounds.Width, ret.Width);
-				ret.Height = std::max(b.Bounds.Y + b.Bounds.Height, ret.Height);
-			}
+		m_tableSize = size;
+		m_types.clear();
+		if (GetCollisionType.IsPure()) {
+			m_types.resize(size);
+			for (size_t i = 0; i < size; i++)
+				m_types[i] = GetCollisionType((int)i);
+		}
+		m_typesVersion = GetCollisionType.GetVersion();
+	}
+	template<typename TileType>
+	void BasicGridWorld<TileType>::m_growTable(int id)
+	{
+		if (id < 0 || (unsigned int)id >= MaxTableSize)
+			return; // negative and very large IDs are rare, just ask the filter for them
+
+		// only fill the new entries if the filter didnt change (otherwise Check() will rebuild the whole table)
+		size_t start = m_tableSize;
+		m_tableSize = std::min<size_t>(std::max<size_t>(start * 2, id + 1), MaxTableSize);
+		if (GetCollisionType.GetVersion() == m_typesVersion && GetCollisionType.IsPure()) {
+			m_types.resize(m_tableSize);
+			for (size_t i = start; i < m_tableSize; i++)
+				m_types[i] = GetCollisionType((int)i);
+		}
+	}
 
-			return Rect(ret.X, ret.Y, ret.Width - ret.X, ret.Height - ret.Y);
+	template<typename TileType>
+	void BasicGridWorld<TileType>::m_buildMask()
+	{
+		m_rowWords = (m_w + 63) / 64;
+		m_mask.assign((size_t)m_rowWords * m_h, 0);
+		for (int y = 0; y < m_h; y++)
+			for (int x = 0; x < m_w; x++)
+				if (m_canHit(m_tiles[(size_t)y * m_w + x]))
+					m_mask[(size_t)y * m_rowWords + (x >> 6)] |= 1ULL << (x & 63);
+	}
+	template<typename TileType>
+	int BasicGridWorld<TileType>::m_nextTile(const uint64_t* mask, int x, int end) const
+	{
+		if (x > end)
+			return end + 1;
+
+		// skip the tiles before x and then whole words of empty tiles
+		int word = x >> 6;
+		int last = end >> 6;
+		uint64_t bits = mask[word] & (~0ULL << (x & 63));
+		while (bits == 0) {
+			if (++word > last)
+				return end + 1;
+			bits = mask[word];
 		}
 
-		// else return 0px region
-		return Rect(0, 0, 0, 0);
+		int found = (word << 6) + countTrailingZeros(bits);
+		return found <= end ? found : end + 1;
+	}
+	template<typename TileType>
+	void BasicGridWorld<TileType>::m_getRange(const Rect& bounds, const Rect& region, int& fromX, int& fromY, int& toX, int& toY) const
+	{
+		// one cell more on each side so that rounding errors cant make us skip a cell
+		auto toCell = [](float value, int size) {
+			float cell = std::floor(value / size);
+			return (int)std::min(std::max(cell, -1073741824.0f), 1073741824.0f);
+		};
+
+		Box bnds(bounds);
+		fromX = std::max((int)region.X, toCell(bnds.MinX, m_cellW) - 1);
+		fromY = std::max((int)region.Y, toCell(bnds.MinY, m_cellH) - 1);
+		toX = std::min((int)region.Width, toCell(bnds.MaxX, m_cellW) + 1);
+		toY = std::min((int)region.Height, toCell(bnds.MaxY, m_cellH) + 1);
+	}
+
+	template class BasicGridWorld<int>;
+	template class BasicGridWorld<uint8_t>;
+	template class BasicGridWorld<uint16_t>;
+
+
+	MappedFile::MappedFile() :
+		m_data(nullptr), m_size(0)
+	{
+#ifdef _WIN32
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = nullptr;
+#else
+		m_file = -1;
+#endif
+	}
+	MappedFile::~MappedFile()
+	{
+		Close();
+	}
+	bool MappedFile::Open(const std::string& filename)
+	{
+		Close();
+
+#ifdef _WIN32
+		m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+			Close();
+			return false;
+		}
+		m_size = (size_t)size.QuadPart;
+
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_mapping == nullptr) {
+			Close();
+			return false;
+		}
+
+		m_data = (const unsigned char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		m_file = open(filename.c_str(), O_RDONLY);
+		if (m_file < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(m_file, &info) != 0 || info.st_size == 0) {
+			Close();
+			return false;
+		}
+		m_size = (size_t)info.st_size;
+
+		void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+		m_data = data == MAP_FAILED ? nullptr : (const unsigned char*)data;
+#endif
+
+		if (m_data == nullptr) {
+			Close();
+			return false;
+		}
+
+		return true;
+	}
+	void MappedFile::Close()
+	{
+#ifdef _WIN32
+		if (m_data != nullptr)
+			UnmapViewOfFile(m_data);
+		if (m_mapping != nullptr)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+		m_mapping = nullptr;
+#else
+		if (m_data != nullptr)
+			munmap((void*)m_data, m_size);
+		if (m_file >= 0)
+			close(m_file);
+		m_file = -1;
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+	void MappedFile::Swap(MappedFile& other)
+	{
+		std::swap(m_data, other.m_data);
+		std::swap(m_size, other.m_size);
+		std::swap(m_file, other.m_file);
+#ifdef _WIN32
+		std::swap(m_mapping, other.m_mapping);
+#endif
 	}
 
 
 
-	void GridWorld::Create(int width, int height, int cellW, int cellH)
+	template<typename TileType>
+	constexpr int BasicChunkedGridWorld<TileType>::ChunkSize;
+	template<typename TileType>
+	constexpr size_t BasicChunkedGridWorld<TileType>::DefaultMemoryBudget;
+	template<typename TileType>
+	constexpr unsigned int BasicChunkedGridWorld<TileType>::MaxTableSize;
+
+	template<typename TileType>
+	BasicChunkedGridWorld<TileType>::BasicChunkedGridWorld() :
+		m_w(0), m_h(0), m_cellW(1), m_cellH(1), m_lastKey(0), m_lastChunk(nullptr),
+		m_budget(DefaultMemoryBudget), m_memory(0), m_tableSize(0), m_typesVersion(0)
+	{}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::Create(int width, int height, int cellW, int cellH)
 	{
 		m_cellH = cellH;
 		m_cellW = cellW;
 		m_w = width;
 		m_h = height;
 
-		// create the gird
-		m_grid.resize(m_h, std::vector<int>(m_w, 0));
+		m_reset();
 
 		// default filter - ID == 0 -> no collision else sold object
 		GetCollisionType = [](int id) -> CollisionType
@@ -302,95 +3549,302 @@ namespace cl
 				return CollisionType::None;
 			return CollisionType::Solid;
 		};
+		GetCollisionType.SetPure(true);
+
+		// narrow tiles can only hold so many IDs, so we can store the type of every one of them
+		m_buildTable(sizeof(TileType) <= 2 ? (size_t)1 << (8 * sizeof(TileType)) : 256);
 	}
-	Point GridWorld::Check(int steps, Rect bounds, Point goal, std::function<void(int, int, int, bool, GridWorld*)> func)
+	template<typename TileType>
+	bool BasicChunkedGridWorld<TileType>::Map(const std::string& filename)
 	{
-		Rect intersect;
+		// check the new file before we let go of the current one, so that a failed Map() doesnt change anything
+		MappedFile file;
+		if (!file.Open(filename))
+			return false;
+
+		// a file saved by GridWorld::Save() or just the tiles?
+		const TileType* data = (const TileType*)file.GetData();
+		if (file.GetSize() >= sizeof(FileHeader) && memcmp(file.GetData(), fileMagic, 4) == 0) {
+			Reader reader;
+			uint32_t version, tileSize;
+			int32_t width, height, cellW, cellH;
+			size_t count;
+			if (!readFile(file, gridFile, version, tileSize, reader, false) || tileSize != sizeof(TileType) || !reader.Read(width) || !reader.Read(height) ||
+				!reader.Read(cellW) || !reader.Read(cellH) || !reader.View(data, count) || width != m_w || height != m_h || count != (size_t)m_w * m_h)
+				return false;
+		} else if (file.GetSize() < (size_t)m_w * m_h * sizeof(TileType))
+			return false;
+
+		// the mapping stays where it is, so data keeps pointing to the tiles (the old file is closed by file's destructor)
+		m_file.Swap(file);
+
+		// chunks that are already loaded came from some other source
+		m_reset();
+
+		LoadChunk = [this, data](int chunkX, int chunkY, TileType* tiles) -> bool
+		{
+			int startX = chunkX * ChunkSize;
+			int startY = chunkY * ChunkSize;
+			int width = std::min(ChunkSize, m_w - startX);
+			int height = std::min(ChunkSize, m_h - startY);
 
-		// the increment per axis for each step
-		float xInc = (goal.X - bounds.X) / steps;
-		float yInc = (goal.Y - bounds.Y) / steps;
+			for (int y = 0; y < height; y++)
+				std::copy(data + (size_t)(startY + y) * m_w + startX, data + (size_t)(startY + y) * m_w + startX + width, tiles + y * ChunkSize);
 
-		// calculate subregion that needs to be checked
-		Rect checkRegion(std::min(goal.X, bounds.X), std::min(goal.Y, bounds.Y), std::max(goal.X, bounds.X + bounds.Width), std::max(goal.Y, bounds.Y + bounds.Height));
-		checkRegion.X = std::max(0, (int)(checkRegion.X - bounds.Width) / m_cellW);
-		checkRegion.Y = std::max(0, (int)(checkRegion.Y - bounds.Height) / m_cellH);
-		checkRegion.Width = std::min((int)(checkRegion.Width + bounds.Width) / m_cellW, m_w - 1);
-		checkRegion.Height = std::min((int)(checkRegion.Height + bounds.Height) / m_cellH, m_h - 1);
-
-		for (int i = 0; i < steps; i++) {
-			// increment along x axis and check for collision
-			bounds.X += xInc;
-			for (int y = (int)checkRegion.Y; y <= (int)checkRegion.Height; y++) {
-				for (int x = (int)checkRegion.X; x <= (int)checkRegion.Width; x++) {
-					int id = m_grid[y][x];
-					CollisionType type = GetCollisionType(id); // fetch the collision type through the filter GetCollisionType
-
-					if (type == CollisionType::None) // no collision checking needed? just skip the body
-						continue;
+			return true;
+		};
+
+		return true;
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::SetObject(int x, int y, int id)
+	{
+		Chunk& chunk = m_getChunk(x / ChunkSize, y / ChunkSize);
+		TileType tile = (TileType)id;
+
+		// give the chunk some storage when the first tile is set
+		if (chunk.Tiles.empty()) {
+			if (tile == 0)
+				return;
+
+			size_t before = m_chunkMemory(chunk);
+			chunk.Tiles.assign(ChunkSize * ChunkSize, 0);
+			chunk.Mask.assign(ChunkSize, 0);
+			m_memory += m_chunkMemory(chunk) - before;
+		}
 
-					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+		int localX = x % ChunkSize;
+		int localY = y % ChunkSize;
+		chunk.Tiles[localY * ChunkSize + localX] = tile;
+		chunk.Modified = true;
 
-					if (cell.Intersects(bounds, intersect)) {
-						// call the user function
-						if (func != nullptr)
-							func(id, x, y, true, this);
+		if ((unsigned int)tile >= m_tableSize && (unsigned int)tile < MaxTableSize)
+			m_buildTable(std::min<size_t>(std::max<size_t>(m_tableSize * 2, tile + 1), MaxTableSize));
 
-						// only check for collision if we encountered a solid object
-						if (type != CollisionType::Solid)
-							continue;
+		uint64_t bit = 1ULL << localX;
+		uint64_t& word = chunk.Mask[localY];
+		word = m_canHit(tile) ? (word | bit) : (word & ~bit);
 
-						float xInter = intersect.Width;
-						float yInter = intersect.Height;
+		m_evict(&chunk);
+	}
+	template<typename TileType>
+	int BasicChunkedGridWorld<TileType>::GetObject(int x, int y)
+	{
+		Chunk& chunk = m_getChunk(x / ChunkSize, y / ChunkSize);
+		if (chunk.Tiles.empty())
+			return 0;
+		return chunk.Tiles[(y % ChunkSize) * ChunkSize + x % ChunkSize];
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::Flush()
+	{
+		if (!SaveChunk)
+			return;
 
-						if (xInter < yInter) {
-							if (bounds.X < cell.X)
-								xInter *= -1; // "bounce" in the direction that depends on the body and user position
+		for (auto& it : m_chunks) {
+			if (!it.second.Modified)
+				continue;
 
-							bounds.X += xInter; // move the user back
+			SaveChunk((int)(unsigned int)(it.first >> 32), (int)(unsigned int)(it.first & 0xFFFFFFFF), it.second.Tiles.data());
+			it.second.Modified = false;
+		}
+	}
+	template<typename TileType>
+	Point BasicChunkedGridWorld<TileType>::Check(int steps, Rect bounds, Point goal, std::function<void(int, int, int, bool, BasicChunkedGridWorld*)> func)
+	{
+		if (func == nullptr)
+			return Check(steps, bounds, goal, NoCallback());
 
-							break;
-						}
-					}
+		return Check(steps, bounds, goal, [&](int id, int x, int y, bool xAxis, BasicChunkedGridWorld* world) {
+			func(id, x, y, xAxis, world);
+		});
+	}
+	template<typename TileType>
+	Point BasicChunkedGridWorld<TileType>::Sweep(Rect bounds, Point goal, std::function<void(int, int, int, bool, BasicChunkedGridWorld*)> func)
+	{
+		COLLY_PROFILE_SCOPE("ChunkedGridWorld::Sweep");
+		if (GetCollisionType.GetVersion() != m_typesVersion)
+			m_buildTable(m_tableSize);
+
+		return sweep<TileHit>(bounds, goal, [&](SweepState<TileHit>& state) {
+			traverseGrid(state.Mover, state.DX, state.DY, m_cellW, m_cellH, m_w, m_h, state.HitTime, [&](int x, int y) {
+				if (m_nextTile(y, x, x) == x) {
+					TileHit tile = { x, y, GetObject(x, y) };
+					state.Add(tile, Box(Rect(x*m_cellW, y*m_cellH, m_cellW, m_cellH)), m_getType(tile.Id));
 				}
+			});
+		}, [&](const TileHit& tile, int axis) {
+			if (func != nullptr) {
+				COLLY_STAT(CallbackInvocations, 1);
+				func(tile.Id, tile.X, tile.Y, axis == 0, this);
 			}
+		});
+	}
+	template<typename TileType>
+	bool BasicChunkedGridWorld<TileType>::Raycast(Point from, Point to, GridRaycastHit& hit, CollisionType type)
+	{
+		COLLY_PROFILE_SCOPE("ChunkedGridWorld::Raycast");
+		if (GetCollisionType.GetVersion() != m_typesVersion)
+			m_buildTable(m_tableSize);
 
-			// increment along y axis and check for collision - repeat everything for Y axis
-			bounds.Y += yInc;
-			for (int y = (int)checkRegion.Y; y <= (int)checkRegion.Height; y++) {
-				for (int x = (int)checkRegion.X; x <= (int)checkRegion.Width; x++) {
-					int id = m_grid[y][x];
-					CollisionType type = GetCollisionType(id);
+		return raycastGrid(from, to, m_cellW, m_cellH, m_w, m_h, hit, [&](int x, int y, int& id) {
+			if (type != CollisionType::None && m_nextTile(y, x, x) != x)
+				return false;
 
-					if (type == CollisionType::None)
-						continue;
+			id = GetObject(x, y);
+			return m_getType(id) == type;
+		});
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::m_buildTable(size_t size)
+	{
+		m_tableSize = size;
+		m_types.clear();
+		if (GetCollisionType.IsPure()) {
+			m_types.resize(size);
+			for (size_t i = 0; i < size; i++)
+				m_types[i] = GetCollisionType((int)i);
+		}
+		m_typesVersion = GetCollisionType.GetVersion();
+	}
+	template<typename TileType>
+	typename BasicChunkedGridWorld<TileType>::Chunk& BasicChunkedGridWorld<TileType>::m_getChunk(int chunkX, int chunkY)
+	{
+		unsigned long long key = CellHash::Key(chunkX, chunkY);
+
+		Chunk* chunk = m_lastChunk;
+		if (chunk == nullptr || key != m_lastKey) {
+			auto it = m_chunks.find(key);
+			if (it != m_chunks.end()) {
+				// move it to the front of the list of used chunks
+				chunk = &it->second;
+				m_used.splice(m_used.begin(), m_used, chunk->Used);
+			} else {
+				// load the chunk - dont store anything if all of its tiles are 0
+				chunk = &m_chunks[key];
+				chunk->Modified = false;
+				chunk->Tiles.assign(ChunkSize * ChunkSize, 0);
+				if (!LoadChunk || !LoadChunk(chunkX, chunkY, chunk->Tiles.data()) ||
+					std::all_of(chunk->Tiles.begin(), chunk->Tiles.end(), [](TileType tile) { return tile == 0; }))
+					std::vector<TileType>().swap(chunk->Tiles);
+
+				m_used.push_front(key);
+				chunk->Used = m_used.begin();
+
+				m_buildMask(*chunk);
+				m_memory += m_chunkMemory(*chunk);
+				m_evict(chunk);
+			}
 
-					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+			m_lastKey = key;
+			m_lastChunk = chunk;
+		}
 
-					if (cell.Intersects(bounds, intersect)) {
-						if (func != nullptr)
-							func(id, x, y, false, this);
+		// the filter changed since the mask was built
+		if (chunk->MaskVersion != m_typesVersion)
+			m_buildMask(*chunk);
 
-						if (type == CollisionType::Cross)
-							continue;
+		return *chunk;
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::m_buildMask(Chunk& chunk)
+	{
+		chunk.MaskVersion = m_typesVersion;
+		if (chunk.Tiles.empty()) {
+			std::vector<uint64_t>().swap(chunk.Mask);
+			return;
+		}
 
-						float xInter = intersect.Width;
-						float yInter = intersect.Height;
+		// make sure the table can store all the IDs in this chunk
+		TileType maxTile = *std::max_element(chunk.Tiles.begin(), chunk.Tiles.end());
+		if ((unsigned int)maxTile >= m_tableSize && (unsigned int)maxTile < MaxTableSize) {
+			m_buildTable(std::min<size_t>(std::max<size_t>(m_tableSize * 2, maxTile + 1), MaxTableSize));
+			chunk.MaskVersion = m_typesVersion;
+		}
 
-						if (yInter < xInter) {
-							if (bounds.Y < cell.Y)
-								yInter *= -1;
+		chunk.Mask.assign(ChunkSize, 0);
+		for (int y = 0; y < ChunkSize; y++)
+			for (int x = 0; x < ChunkSize; x++)
+				if (m_canHit(chunk.Tiles[y * ChunkSize + x]))
+					chunk.Mask[y] |= 1ULL << x;
+	}
+	template<typename TileType>
+	size_t BasicChunkedGridWorld<TileType>::m_chunkMemory(const Chunk& chunk) const
+	{
+		return sizeof(Chunk) + sizeof(unsigned long long) * 2 + chunk.Tiles.capacity() * sizeof(TileType) + chunk.Mask.capacity() * sizeof(uint64_t);
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::m_evict(const Chunk* keep)
+	{
+		// go from the least recently used chunk to the most recently used one
+		auto it = m_used.end();
+		while (m_memory > m_budget && it != m_used.begin()) {
+			--it;
+
+			auto chunkIt = m_chunks.find(*it);
+			Chunk& chunk = chunkIt->second;
+			if (&chunk == keep)
+				continue;
+
+			// we cant lose the changes
+			if (chunk.Modified) {
+				if (!SaveChunk)
+					continue;
+				SaveChunk((int)(unsigned int)(*it >> 32), (int)(unsigned int)(*it & 0xFFFFFFFF), chunk.Tiles.data());
+			}
 
-							bounds.Y += yInter;
+			if (&chunk == m_lastChunk)
+				m_lastChunk = nullptr;
 
-							break;
-						}
-					}
+			m_memory -= m_chunkMemory(chunk);
+			m_chunks.erase(chunkIt);
+			it = m_used.erase(it);
+		}
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::m_reset()
+	{
+		m_chunks.clear();
+		m_used.clear();
+		m_lastChunk = nullptr;
+		m_memory = 0;
+	}
+	template<typename TileType>
+	int BasicChunkedGridWorld<TileType>::m_nextTile(int y, int x, int end)
+	{
+		// a row of a chunk has exactly 64 tiles, so its mask is a single word
+		while (x <= end) {
+			const Chunk& chunk = m_getChunk(x / ChunkSize, y / ChunkSize);
+			if (!chunk.Mask.empty()) {
+				uint64_t bits = chunk.Mask[y % ChunkSize] & (~0ULL << (x % ChunkSize));
+				if (bits != 0) {
+					int found = x - x % ChunkSize + countTrailingZeros(bits);
+					return found <= end ? found : end + 1;
 				}
 			}
 
+			x += ChunkSize - x % ChunkSize; // skip to the next chunk
 		}
 
-		return { bounds.X, bounds.Y };
+		return end + 1;
+	}
+	template<typename TileType>
+	void BasicChunkedGridWorld<TileType>::m_getRange(const Rect& bounds, const Rect& region, int& fromX, int& fromY, int& toX, int& toY) const
+	{
+		// one cell more on each side so that rounding errors cant make us skip a cell
+		auto toCell = [](float value, int size) {
+			float cell = std::floor(value / size);
+			return (int)std::min(std::max(cell, -1073741824.0f), 1073741824.0f);
+		};
+
+		Box bnds(bounds);
+		fromX = std::max((int)region.X, toCell(bnds.MinX, m_cellW) - 1);
+		fromY = std::max((int)region.Y, toCell(bnds.MinY, m_cellH) - 1);
+		toX = std::min((int)region.Width, toCell(bnds.MaxX, m_cellW) + 1);
+		toY = std::min((int)region.Height, toCell(bnds.MaxY, m_cellH) + 1);
 	}
-}
\ No newline at end of file
+
+	template class BasicChunkedGridWorld<int>;
+	template class BasicChunkedGridWorld<uint8_t>;
+	template class BasicChunkedGridWorld<uint16_t>;
+}
@@ -2,7 +2,36 @@
 #define __COLLY_H__
 
 #include <vector>
+#include <cstdint>
+#include <cstddef>
 #include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <list>
+#include <string>
+
+// COLLY_STAT(name, n) adds n to a counter of cl::Stats and COLLY_PROFILE_SCOPE(name) calls the profiling hooks
+// at its start and at the end of the scope. They do nothing unless COLLY_STATS / COLLY_PROFILE is defined - define
+// them for the whole project, since the templated functions at the end of this file are compiled in your code.
+#ifdef COLLY_STATS
+#define COLLY_STAT(name, n) cl::AddStat(cl::StatCounter::name, (uint64_t)(n))
+#else
+#define COLLY_STAT(name, n)
+#endif
+
+#ifdef COLLY_PROFILE
+#define COLLY_PROFILE_NAME(line) profileScope##line
+#define COLLY_PROFILE_SCOPE_AT(name, line) cl::ProfileScope COLLY_PROFILE_NAME(line)(name)
+#define COLLY_PROFILE_SCOPE(name) COLLY_PROFILE_SCOPE_AT(name, __LINE__)
+#else
+#define COLLY_PROFILE_SCOPE(name)
+#endif
 
 namespace cl
 {
@@ -29,10 +58,32 @@ namespace cl
 		Rect(float x, float y, float width, float height);
 
 		// does this rectangle intersect another rectangle?
-		bool Intersects(const Rect& other, Rect& intersection);
+		bool Intersects(const Rect& other, Rect& intersection) const;
 
 		// is this rectangle exactly the same as another rectangle (has same position and size)
-		inline bool operator==(const Rect& r) { return X == r.X && Y == r.Y && Width == r.Width && Height == r.Height; }
+		inline bool operator==(const Rect& r) const { return X == r.X && Y == r.Y && Width == r.Width && Height == r.Height; }
+	};
+
+
+
+	/*
+		Box is a rectangle stored as its min and max corner. It is used by the spatial
+		structures since overlap tests dont have to recompute the corners every time.
+		Overlaps() gives the same answer as Rect::Intersects().
+	*/
+	struct Box
+	{
+		float MinX, MinY, MaxX, MaxY;
+
+		Box();
+		Box(const Rect& r);
+		Box(float minX, float minY, float maxX, float maxY);
+
+		// do the two boxes overlap (with positive non zero area)?
+		inline bool Overlaps(const Box& o) const { return std::max(MinX, o.MinX) < std::min(MaxX, o.MaxX) && std::max(MinY, o.MinY) < std::min(MaxY, o.MaxY); }
+
+		// is the other box completely inside of this box?
+		inline bool Contains(const Box& o) const { return o.MinX >= MinX && o.MinY >= MinY && o.MaxX <= MaxX && o.MaxY <= MaxY; }
 	};
 
 
@@ -51,9 +102,19 @@ namespace cl
 
 
 
+	/*
+		Collision layers - every body is in the layers whose bits are set in its Category and
+		only collides with the bodies whose Category has one of the bits of its Mask. By default
+		a body is in the first layer and collides with all of them.
+	*/
+	constexpr uint32_t DefaultCategory = 1;
+	constexpr uint32_t AllCategories = 0xFFFFFFFF;
+
+
+
 	/*
 		Body is just a rectangle with addition information. It can have its own ID or 
-		some user data attached. It also has a collision type.
+		some user data attached. It also has a collision type and collision layers.
 	*/
 	struct Body
 	{
@@ -61,8 +122,191 @@ namespace cl
 		Rect Bounds;
 		CollisionType Type;
 		void* UserData;
+		uint32_t Category;	// layers this body is in
+		uint32_t Mask;		// layers this body collides with
+
+		Body() : Id(0), Type(CollisionType::None), UserData(nullptr), Category(DefaultCategory), Mask(AllCategories) {}
+		Body(int id, Rect bounds, CollisionType type, void* data = nullptr, uint32_t category = DefaultCategory, uint32_t mask = AllCategories) :
+			Id(id), Bounds(bounds), Type(type), UserData(data), Category(category), Mask(mask) {}
+
+		// can these two bodies collide? (each of them has to be in one of the layers the other one collides with)
+		inline bool CollidesWith(const Body& o) const { return (Category & o.Mask) != 0 && (o.Category & Mask) != 0; }
+
+		bool operator==(const Body& bdy) const { return Id == bdy.Id && Bounds == bdy.Bounds && Type == bdy.Type && UserData == bdy.UserData && Category == bdy.Category && Mask == bdy.Mask; }
+	};
+
+
+
+	/*
+		BodyHandle is returned by World::AddObject and identifies one body in the world.
+		A handle stays valid until the body is removed (after that it might be reused
+		for some other body).
+	*/
+	typedef unsigned int BodyHandle;
+
+
+
+	/*
+		BodyRef is a handle + the generation of the body it was given to. Handles of removed bodies
+		are reused, so a handle alone cant tell if it still points to the same body - World::IsValid()
+		returns false for a BodyRef once its body is removed, even if the handle is used again.
+	*/
+	struct BodyRef
+	{
+		BodyHandle Handle;
+		unsigned int Generation;
+	};
+
+
+
+	/*
+		Two bodies that overlap each other.
+	*/
+	struct BodyPair
+	{
+		BodyHandle A, B;
+	};
+
+
+
+	/*
+		RaycastHit describes a body hit by World::Raycast(). Fraction tells how far along
+		the ray the body was hit (0 = start, 1 = end), Position is the point where it was
+		hit and Normal points out of the side of the body that was hit (it is (0, 0) if
+		the ray starts inside of the body).
+	*/
+	struct RaycastHit
+	{
+		BodyHandle Handle;
+		float Fraction;
+		Point Position;
+		Point Normal;
+	};
+
+
+
+	/*
+		Stats counts the work done by Colly so that you can see where the time goes (for example
+		if World::Check() spends it in the broad phase query or in resolving the collisions).
+		The counters are only updated if COLLY_STATS is defined - otherwise they always stay 0
+		and counting doesnt cost anything. Each thread counts its own work and GetStats() returns
+		the sum for all the threads. Depth and node count of a quadtree can be read with
+		QuadTree::GetDepth() and QuadTree::GetNodeCount().
+	*/
+	struct Stats
+	{
+		uint64_t NodesVisited;			// tree nodes, hash cells or sorted list entries looked at by broad phase queries
+		uint64_t CandidatesReturned;	// bodies returned by broad phase queries
+		uint64_t IntersectionTests;		// tests of the moving body against bodies/tiles in Check() and CheckMany()
+		uint64_t SolidResolutions;		// how many times the moving body was pushed back by a solid body/tile
+		uint64_t CallbackInvocations;	// calls of the user functions passed to Check(), Sweep() and CheckMany()
+		uint64_t BytesAllocated;		// memory allocated by the trees and by the temporary lists of the queries
+	};
+
+	// get the sum of the counters of all the threads / set them back to 0 (shouldnt be called while other threads use Colly)
+	Stats GetStats();
+	void ResetStats();
+
+	// the counters of Stats - COLLY_STAT(name, n) adds n to one of them for the calling thread
+	enum class StatCounter
+	{
+		NodesVisited,
+		CandidatesReturned,
+		IntersectionTests,
+		SolidResolutions,
+		CallbackInvocations,
+		BytesAllocated,
+		Count
+	};
+	void AddStat(StatCounter counter, uint64_t n);
+
+	/*
+		Profiling hooks - if COLLY_PROFILE is defined, begin is called when some of the functions
+		(World::Check, World::Sweep, GridWorld::Check, ...) or their parts start and end is called
+		once they are done, so that they can be forwarded to your own profiler. The name is a string
+		literal like "World::Check" or "World::Check/Query". Either hook can be null. Set them before
+		the other threads start using Colly.
+	*/
+	typedef void(*ProfileHook)(const char* name);
+	void SetProfileHooks(ProfileHook begin, ProfileHook end);
+
+	// calls the begin hook when it is created and the end hook when it is destroyed - COLLY_PROFILE_SCOPE(name) creates one
+	class ProfileScope
+	{
+	public:
+		ProfileScope(const char* name);
+		~ProfileScope();
+
+		ProfileScope(const ProfileScope&) = delete;
+		ProfileScope& operator=(const ProfileScope&) = delete;
+
+	private:
+		const char* m_name;
+	};
+
+
+
+	/*
+		BroadPhase is a structure that organizes the bodies of a World so that we can
+		quickly find the bodies near some region. The World tells it when a body is
+		added, moved or removed. Bodies are stored in the array passed to the constructor,
+		the structure only keeps their handles. All queries are safe to run on multiple
+		threads at the same time as long as nobody is modifying the structure.
+	*/
+	class BroadPhase
+	{
+	public:
+		BroadPhase(const std::vector<Body>& bodies) : m_bodies(&bodies) {}
+		virtual ~BroadPhase() {}
+
+		// delete all the data - bnds is the region where most of the objects will be
+		virtual void Reset(const Rect& bnds) = 0;
+
+		// add an object
+		virtual void Insert(BodyHandle handle) = 0;
+
+		// remove an object (the object must have the same bounds it was inserted with)
+		virtual void Remove(BodyHandle handle) = 0;
 
-		bool operator==(const Body& bdy) { return Id == bdy.Id && Bounds == bdy.Bounds && Type == bdy.Type && UserData == bdy.UserData; }
+		// update an object after its bounds were changed from oldBounds
+		virtual void Move(BodyHandle handle, const Rect& oldBounds) = 0;
+
+		// get handles of all the objects (that arent CollisionType::None) in a given range whose Category has one of
+		// the bits of mask, each object is returned only once
+		inline void Query(const Rect& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const { Query(Box(bnd), elements, mask); }
+		virtual void Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const = 0;
+
+		// get all pairs of overlapping objects where A is of type typeA and B is of type typeB (each pair is
+		// returned once, if both types are the same then A < B). Bodies of type None and bodies whose layers
+		// dont match (see Body::CollidesWith) are skipped.
+		virtual void FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const = 0;
+
+		// gets the objects a ray might hit - Visit() returns the fraction of the ray after which we can stop looking
+		struct RayVisitor
+		{
+			virtual ~RayVisitor() {}
+			virtual float Visit(BodyHandle handle) = 0;
+		};
+
+		// pass every object (that isnt CollisionType::None) the segment from -> from + (dx, dy) might hit to the
+		// visitor, each object only once and roughly in the order the segment gets to them. Objects the segment
+		// only gets to after limit (or after the fraction returned by the last Visit()) are skipped.
+		virtual void Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const = 0;
+
+		// write the structure to a buffer / read it back (returns false if the data isnt valid) - structures
+		// that are quick to build dont store anything and are rebuilt when a World is loaded
+		virtual void Save(std::vector<unsigned char>& /*data*/) const {}
+		virtual bool Load(const unsigned char* /*data*/, size_t /*size*/) { return false; }
+
+	protected:
+		// add a pair of overlapping objects if their types match typeA and typeB and their layers match (swaps them if needed)
+		void m_addPair(std::vector<BodyPair>& pairs, BodyHandle a, BodyHandle b, CollisionType typeA, CollisionType typeB) const;
+
+		// get a stamp that no body has been marked with yet + the last stamp of each body (stored per thread)
+		unsigned int m_nextStamp(unsigned int*& stamps) const;
+
+		// the bodies our handles point to
+		const std::vector<Body>* m_bodies;
 	};
 
 
@@ -71,66 +315,500 @@ namespace cl
 		QuadTree is used to optimize collision checking in large non grid/tile-based
 		worlds. Using quad tree we can gather only elements that need to be checked.
 		Therefore, having 10, 1000 or 10000 objects wont slow our physics too much.
+		All nodes are stored in one array (the four children of a node are always
+		next to each other) which is reused when the tree is reset or nodes are merged.
+		Only leaves store objects - a leaf is split once it holds more than Capacity objects,
+		unless it is MaxDepth levels deep or its objects are so big/overlapping that splitting
+		would just copy them to all the children (such leaves can hold any number of objects).
+		The tree grows when an object is inserted outside of its bounds. Every node knows which
+		layers the objects under it are in, so queries skip the parts of the tree that dont have
+		any objects in the layers they are looking for.
 	*/
-	class QuadTree
+	class QuadTree : public BroadPhase
 	{
 	public:
-		// the max capacity of this quad tree
-		static constexpr int Capacity = 4;
+		// default number of objects a leaf can hold before it is split and the default depth limit (the capacity
+		// was fixed at 4 before it could be changed - SetCapacity(4) gives the old layout of the tree)
+		static constexpr int DefaultCapacity = 8;
+		static constexpr int DefaultMaxDepth = 12;
 
-		QuadTree(const Rect& bnds);
-		~QuadTree();
+		QuadTree(const std::vector<Body>& bodies, const Rect& bnds = Rect());
 
 		// delete all the data that was stored in this quadtree
-		void Reset(const Rect& bnds);
+		void Reset(const Rect& bnds) override;
+
+		// change the leaf capacity and max depth - only affects the nodes that are split after the call,
+		// so these should be set before building the tree
+		inline void SetCapacity(int capacity) { m_maxCapacity = std::max(capacity, 1); }
+		inline void SetMaxDepth(int depth) { m_maxDepth = std::max(depth, 0); }
+		inline int GetCapacity() const { return m_maxCapacity; }
+		inline int GetMaxDepth() const { return m_maxDepth; }
+
+		// number of levels of the tree (1 if the root is a leaf) and the number of nodes in use
+		int GetDepth() const;
+		inline size_t GetNodeCount() const { return m_nodes.size() - m_freeNodes.size() * 4; }
+
+		// BroadPhase functions
+		void Insert(BodyHandle handle) override;
+		void Remove(BodyHandle handle) override;
+		void Move(BodyHandle handle, const Rect& oldBounds) override;
+		using BroadPhase::Query;
+		void Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const override;
+		void FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const override;
+		void Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const override;
+		void Save(std::vector<unsigned char>& data) const override;
+		bool Load(const unsigned char* data, size_t size) override;
+
+	private:
+		// index used for nodes that dont have children and for the end of element lists
+		static constexpr unsigned int None = 0xFFFFFFFF;
+
+		// a single node - its children are stored at FirstChild, FirstChild+1, FirstChild+2 and FirstChild+3
+		// (top left, top right, bottom left and bottom right), leaves have a linked list of elements instead.
+		// Categories has the bits of the Category of every object in the node and its children.
+		struct Node
+		{
+			Box Bounds;
+			unsigned int FirstChild;
+			unsigned int FirstElement;
+			int Count;
+			uint32_t Categories;
+		};
+
+		// an object stored in a leaf
+		struct Element
+		{
+			BodyHandle Handle;
+			unsigned int Next;
+		};
+
+		// insert an object in the given node or its children
+		void m_insert(unsigned int node, int depth, BodyHandle handle, const Box& bnds);
+
+		// remove an object from the given node and its children
+		void m_remove(unsigned int node, BodyHandle handle, const Box& bnds);
+
+		// get all the objects in a given range (that are in one of the layers of mask) from the given node and its children
+		void m_query(unsigned int node, const Box& bnd, uint32_t mask, std::vector<BodyHandle>& elements, unsigned int* stamps, unsigned int stamp) const;
+
+		// visit the objects a ray might hit in the given node and its children (children are visited in the order the ray enters them)
+		void m_raycast(unsigned int node, Point from, float dx, float dy, RayVisitor& visitor, float& limit, unsigned int* stamps, unsigned int stamp) const;
+
+		// find the overlapping pairs in the given node and its children - leaf is a buffer for the elements of a single leaf
+		void m_findPairs(unsigned int node, std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB, std::vector<std::pair<BodyHandle, Box>>& leaf) const;
+
+		// turn the given node into a leaf if its children are leaves that dont hold more than Capacity objects
+		void m_merge(unsigned int node);
+
+		// double the size of the root node until it contains the given box
+		void m_grow(const Box& bnds);
+
+		// would splitting the given full leaf separate its elements (or just copy them to all the children)?
+		bool m_shouldSplit(unsigned int node, const Box& bnds) const;
+
+		// subdivide the given leaf and move its elements to the new children
+		void m_subdivide(unsigned int node, int depth);
+
+		// create children of the given node which meet at the given point
+		void m_split(unsigned int node, float midX, float midY);
+
+		// get four nodes that are next to each other
+		unsigned int m_allocateNodes();
 
-		// insert an object in this quadtree
-		void Insert(const Body& bdy);
+		// add an element to the list of the given leaf
+		void m_addElement(unsigned int node, BodyHandle handle);
 
-		// get all the objects in a given range
-		void Query(const Rect& bnd, std::vector<Body>& elements);
+		// calculate the Categories of the given node from its elements or children
+		void m_updateCategories(unsigned int node);
+
+		// leaf capacity and depth limit
+		int m_maxCapacity, m_maxDepth;
+
+		// node pool (root is always the first node) + list of four-node blocks we can reuse
+		std::vector<Node> m_nodes;
+		std::vector<unsigned int> m_freeNodes;
+
+		// element pool + the first element of the list of unused elements
+		std::vector<Element> m_elements;
+		unsigned int m_freeElement;
+	};
+
+
+
+	/*
+		SweepAndPrune keeps the bodies in two lists - one sorted by the left edge and one
+		sorted by the top edge. A query only looks at the part of one of the lists that
+		can overlap the query region, so it works well for levels that are spread along
+		one axis (long corridors) where a QuadTree would get deep and unbalanced. Moving
+		an object shifts it to its new place in the lists (insertion sort), which is cheap
+		when objects move a bit every frame. New objects are sorted into the lists in
+		bulk before the next query.
+	*/
+	class SweepAndPrune : public BroadPhase
+	{
+	public:
+		SweepAndPrune(const std::vector<Body>& bodies);
+
+		// BroadPhase functions
+		void Reset(const Rect& bnds) override;
+		void Insert(BodyHandle handle) override;
+		void Remove(BodyHandle handle) override;
+		void Move(BodyHandle handle, const Rect& oldBounds) override;
+		using BroadPhase::Query;
+		void Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const override;
+		void FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const override;
+		void Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const override;
+
+	private:
+		// handle used for removed entries and position of objects that arent in the lists
+		static constexpr unsigned int None = 0xFFFFFFFF;
+
+		// an object in one of the lists
+		struct Entry
+		{
+			Box Bounds;
+			BodyHandle Handle;
+		};
+
+		// sort the newly added objects into the lists and drop the removed entries
+		void m_flush() const;
+
+		// move an entry to the right place in the list after its bounds changed
+		void m_shift(int axis, unsigned int index);
+
+		// entries sorted by MinX and MinY + position of each object in those lists
+		mutable std::vector<Entry> m_lists[2];
+		mutable std::vector<unsigned int> m_positions[2];
+
+		// number of sorted entries (the ones after them were added since the last flush) and removed entries
+		mutable size_t m_sorted;
+		mutable size_t m_removed;
+
+		// the biggest width and height of an object - tells us how far back a query has to look
+		float m_maxSize[2];
+
+		// are there any entries waiting to be sorted? (the lock makes sure only one thread sorts them)
+		mutable std::atomic<bool> m_dirty;
+		mutable std::mutex m_lock;
+	};
+
+
+
+	/*
+		CellHash is used for hash maps of grid cells - Key() packs the coordinates of a cell
+		into one number and the hash mixes its bits so that neighbouring cells dont end up
+		in neighbouring buckets.
+	*/
+	struct CellHash
+	{
+		static inline unsigned long long Key(int x, int y) { return ((unsigned long long)(unsigned int)x << 32) | (unsigned int)y; }
+
+		inline size_t operator()(unsigned long long key) const
+		{
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			return (size_t)key;
+		}
+	};
+
+
+
+	/*
+		SpatialHash splits the world into square cells of the same size and keeps a list
+		of objects for every cell that has been used (cells are stored in a hash map, so
+		the world doesnt need any bounds). Inserting, moving and removing an object only
+		touches the cells it covers and moving an object inside of the same cells costs
+		almost nothing. It works best when objects are about as big as a cell and are
+		spread around the world. Objects that would cover more than MaxCells cells are
+		kept in a separate list that every query goes through.
+	*/
+	class SpatialHash : public BroadPhase
+	{
+	public:
+		// default width and height of a cell + number of cells an object can cover before it goes to the list of large objects
+		static constexpr float DefaultCellSize = 64.0f;
+		static constexpr int MaxCells = 16;
+
+		SpatialHash(const std::vector<Body>& bodies, float cellSize = DefaultCellSize);
+
+		// change the size of the cells (objects that are already stored are inserted again)
+		void SetCellSize(float size);
+		inline float GetCellSize() const { return m_cellSize; }
+
+		// BroadPhase functions
+		void Reset(const Rect& bnds) override;
+		void Insert(BodyHandle handle) override;
+		void Remove(BodyHandle handle) override;
+		void Move(BodyHandle handle, const Rect& oldBounds) override;
+		using BroadPhase::Query;
+		void Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const override;
+		void FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const override;
+		void Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const override;
+
+	private:
+		// cells covered by a box (including MaxX and MaxY)
+		struct CellRange
+		{
+			int MinX, MinY, MaxX, MaxY;
+		};
+
+		// get the cells a box covers
+		CellRange m_getRange(const Box& bnds) const;
+
+		// should an object that covers these cells be stored in the list of large objects?
+		inline bool m_isLarge(const CellRange& r) const { return (long long)(r.MaxX - r.MinX + 1) * (r.MaxY - r.MinY + 1) > MaxCells; }
+
+		// add/remove an object to/from the given cells (or the list of large objects)
+		void m_insert(BodyHandle handle, const CellRange& range);
+		void m_remove(BodyHandle handle, const CellRange& range);
+
+		// get all the objects stored in the given cells that overlap the given box (and are in one of the layers of mask)
+		void m_gather(const CellRange& range, const Box& bnd, uint32_t mask, std::vector<BodyHandle>& elements, unsigned int* stamps, unsigned int stamp) const;
+
+		// objects in each cell (empty cells stay in the map so that they dont have to be allocated again)
+		std::unordered_map<unsigned long long, std::vector<BodyHandle>, CellHash> m_cells;
+
+		// objects that cover too many cells
+		std::vector<BodyHandle> m_large;
+
+		// size of a cell and 1/size
+		float m_cellSize, m_invCellSize;
+	};
+
+
+
+	/*
+		PackedTree is built in one go - objects are sorted along a Hilbert curve (so objects
+		next to each other in the list are also close in the world) and packed into Width-wide
+		nodes, Width nodes at a time, until only the root is left. Every object is stored
+		exactly once and the tree is always full and balanced, so queries visit far fewer
+		nodes than in a QuadTree. Each node keeps the bounds and layers of its children in
+		separate arrays so that all of them can be tested at once. Adding, moving or removing an
+		object only marks the tree as dirty and the whole tree is built again before the next
+		query, so it is meant for objects that (almost) never move, like level geometry.
+	*/
+	class PackedTree : public BroadPhase
+	{
+	public:
+		// number of children of a node
+		static constexpr int Width = 8;
+
+		PackedTree(const std::vector<Body>& bodies);
+
+		// BroadPhase functions
+		void Reset(const Rect& bnds) override;
+		void Insert(BodyHandle handle) override;
+		void Remove(BodyHandle handle) override;
+		void Move(BodyHandle handle, const Rect& oldBounds) override;
+		using BroadPhase::Query;
+		void Query(const Box& bnd, std::vector<BodyHandle>& elements, uint32_t mask = AllCategories) const override;
+		void FindPairs(std::vector<BodyPair>& pairs, CollisionType typeA, CollisionType typeB) const override;
+		void Raycast(Point from, float dx, float dy, float limit, RayVisitor& visitor) const override;
+		void Save(std::vector<unsigned char>& data) const override;
+		bool Load(const unsigned char* data, size_t size) override;
+
+	private:
+		// index used for empty slots and objects that arent in the tree
+		static constexpr unsigned int None = 0xFFFFFFFF;
+
+		// bounds of the children, the layers of the objects in them (Category of the body in leaves) and their indices
+		// (body handles in leaves, node indices in the other nodes). Empty slots have inverted infinite bounds and
+		// no layers so they never overlap anything.
+		struct Node
+		{
+			float MinX[Width], MinY[Width], MaxX[Width], MaxY[Width];
+			uint32_t Categories[Width];
+			unsigned int Child[Width];
+		};
+
+		// build the tree again if objects were added, moved or removed since it was last built
+		void m_flush() const;
+
+		// call visit(handle, index) for every object whose bounds overlap the box and whose Category has one of the
+		// bits of layers - index is the position of the object in the leaves (bodies of type None arent skipped)
+		template<typename Visit>
+		void m_visit(const Box& bnd, uint32_t layers, Visit visit) const;
+
+		// all the objects in the tree + position of each object in that list
+		std::vector<BodyHandle> m_handles;
+		std::vector<unsigned int> m_positions;
+
+		// nodes (root first, leaves at the end starting at m_firstLeaf)
+		mutable std::vector<Node> m_nodes;
+		mutable unsigned int m_firstLeaf;
+
+		// does the tree have to be built again? (the lock makes sure only one thread builds it)
+		mutable std::atomic<bool> m_dirty;
+		mutable std::mutex m_lock;
+	};
+
+
+
+	/*
+		ThreadPool runs a list of tasks on multiple threads. Tasks are split evenly
+		between the threads and a thread that runs out of tasks steals half of the
+		remaining tasks of some other thread. The thread that calls Run also works
+		on the tasks, so a pool with one thread runs everything on the calling thread.
+	*/
+	class ThreadPool
+	{
+	public:
+		// create a pool with the given number of threads (0 = one per CPU core)
+		ThreadPool(unsigned int threads = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		// number of threads that work on the tasks (including the one calling Run)
+		inline unsigned int GetThreadCount() const { return m_threadCount; }
+
+		// call task(i, thread) for each i in [0, count) and wait until all of them are done
+		void Run(size_t count, const std::function<void(size_t, unsigned int)>& task);
 
 	private:
-		// subdivide this node
-		void m_subdivide();
+		// tasks that belong to a single thread
+		struct Queue
+		{
+			std::mutex Lock;
+			size_t Begin, End;
+		};
 
-		// add an element to an array
-		void m_add(const Body& bdy);
+		// main function of the worker threads
+		void m_loop(unsigned int thread);
 
-		// list of our elements
-		Body m_elements[QuadTree::Capacity];
-		int m_capacity;
+		// run tasks from our own queue and steal the others' tasks until there is nothing left
+		void m_work(unsigned int thread);
 
-		// node bounds and child nodes
-		Rect m_bounds;
-		QuadTree * m_topLeft, *m_topRight, *m_bottomLeft, *m_bottomRight;
+		// take a task from our own queue or take half of some other thread's tasks
+		bool m_pop(unsigned int thread, size_t& task);
+		bool m_steal(unsigned int thread, size_t& task);
+
+		unsigned int m_threadCount;
+		std::unique_ptr<Queue[]> m_queues;
+		std::vector<std::thread> m_threads;
+
+		// current task + what the workers are waiting for
+		const std::function<void(size_t, unsigned int)>* m_task;
+		std::mutex m_lock;
+		std::condition_variable m_wake, m_done;
+		size_t m_generation;
+		unsigned int m_busy;
+		bool m_quit;
+	};
+
+
+
+	/*
+		Broad phase structures that World can use
+	*/
+	enum class BroadPhaseType
+	{
+		QuadTree,		// good for most worlds
+		SweepAndPrune,	// good for worlds spread along one axis
+		SpatialHash,	// good for worlds full of similar sized moving objects
+		PackedTree		// good for worlds where objects (almost) never move
+	};
+
+
+
+	/*
+		NoCallback can be passed to the templated Check() functions when you dont need to know what
+		the body hit - the code that would call the function is removed completely.
+	*/
+	struct NoCallback
+	{
+		template<typename... Args>
+		inline void operator()(Args&&...) const {}
 	};
 
 
 
 	/*
 		World is the main class. It keeps track of all the elements
-		in the level and organizes them in the QuadTree (note: you
-		must manually build the QuadTree by calling the UpdateQuadTree
-		function).
+		in the level and organizes them in the QuadTree (or some other BroadPhase).
+		Adding, moving and removing an object only updates the parts of the QuadTree
+		the object is in. UpdateQuadTree rebuilds the whole tree - call it after changing
+		the bodies directly through GetObjects() (or UpdateStaticTree for static objects).
+		Bodies pushed to the end of GetObjects() are added as dynamic objects by
+		UpdateQuadTree (or by the next AddObject) and bodies removed from its end are
+		taken out of both trees.
+		Objects added with AddStaticObject (level geometry that never moves) are kept in
+		a separate PackedTree that is built in one go right before it is needed and isnt
+		touched when the other objects change. Queries and collision checks go through
+		both trees. The world also keeps a list of handles for every id, so finding or
+		removing the objects with some id only touches those objects. Check() and Sweep() can be given a Body instead of a Rect - then only
+		the objects whose layers match the layers of that body are checked (the trees skip
+		the parts that dont have any such objects). With a Rect, the moving object is in
+		every layer and collides with all of them.
 	*/
 	class World
 	{
 	public:
-		World();
+		World(BroadPhaseType type = BroadPhaseType::QuadTree);
+
+		// the BroadPhase points to our list of bodies so the world cant be copied
+		World(const World&) = delete;
+		World& operator=(const World&) = delete;
 
-		// getting and adding an object
+		// getting and adding an object (removed objects stay in this list as CollisionType::None
+		// bodies until their handle is reused)
 		inline std::vector<Body>& GetObjects() { return m_bodies; }
-		inline void AddObject(int id, Rect bounds, CollisionType type, void* data = nullptr) { AddObject({ id, bounds, type, data }); }
-		inline void AddObject(const Body& body) { m_bodies.push_back(body); }
+		inline BodyHandle AddObject(int id, Rect bounds, CollisionType type, void* data = nullptr) { return AddObject({ id, bounds, type, data }); }
+		inline BodyHandle AddObject(const Body& body) { return m_add(body, false); }
+
+		// add an object that (almost) never moves or gets removed - changing a static object rebuilds the
+		// whole static tree before the next query
+		inline BodyHandle AddStaticObject(int id, Rect bounds, CollisionType type, void* data = nullptr) { return AddStaticObject({ id, bounds, type, data }); }
+		inline BodyHandle AddStaticObject(const Body& body) { return m_add(body, true); }
+		inline bool IsStatic(BodyHandle handle) const { return m_static[handle]; }
+
+		// get, move and remove a single object (removing an object that was already removed does nothing)
+		inline Body& GetObject(BodyHandle handle) { return m_bodies[handle]; }
+		void MoveObject(BodyHandle handle, const Rect& bounds);
+		void RemoveObject(BodyHandle handle);
+
+		// is the handle used by an object that hasnt been removed?
+		inline bool IsAlive(BodyHandle handle) const { return handle < m_alive.size() && m_alive[handle]; }
+
+		// get a reference that remembers which object the handle was given to / is that object still in the world?
+		inline BodyRef GetRef(BodyHandle handle) const { return { handle, m_generations[handle] }; }
+		inline bool IsValid(const BodyRef& ref) const { return IsAlive(ref.Handle) && m_generations[ref.Handle] == ref.Generation; }
+
+		// change the layers of an object (if you change them through GetObjects(), call UpdateQuadTree/UpdateStaticTree)
+		void SetObjectLayers(BodyHandle handle, uint32_t category, uint32_t mask);
+
+		// change the id of an object (if you change it through GetObjects(), call UpdateQuadTree)
+		void SetObjectId(BodyHandle handle, int id);
 
 		// reset the world
 		void Clear();
 
-		// build the tree
+		// rebuild the whole tree (or the other BroadPhase) and the lists of objects with each id - static objects arent in the tree
 		void UpdateQuadTree();
 
-		// get and remove objects with a given id
+		// rebuild the tree of static objects (only needed if you changed them through GetObjects())
+		void UpdateStaticTree();
+
+		// save all the objects (and the quadtree) to a file / load them - Load() returns false and doesnt change
+		// anything if the file is missing, truncated or corrupted. UserData isnt saved (it is nullptr after loading).
+		bool Save(const std::string& filename) const;
+		bool Load(const std::string& filename);
+
+		// get handles of all the objects in a given range (only the ones in one of the layers of mask)
+		inline void Query(const Rect& bnd, std::vector<BodyHandle>& bodies, uint32_t mask = AllCategories) { m_query(Box(bnd), mask, bodies); }
+
+		// find the first object of the given type (in one of the layers of mask) on the line from -> to (line of sight checks,
+		// hitscan weapons, etc...). The quadtree (or the other BroadPhase) is walked from the start of the line to its end and
+		// stops once it is past the closest hit. Objects hit at the same time are ordered by their handle. No memory is allocated.
+		bool Raycast(Point from, Point to, RaycastHit& hit, CollisionType type = CollisionType::Solid, uint32_t mask = AllCategories) const;
+
+		// get all the objects of the given type (in one of the layers of mask) on the line from -> to ordered by the Fraction at
+		// which they are hit (hits is cleared first, no memory is allocated once it has grown)
+		void RaycastAll(Point from, Point to, std::vector<RaycastHit>& hits, CollisionType type = CollisionType::Solid, uint32_t mask = AllCategories) const;
+
+		// get (in the order of their handles) and remove objects with a given id - only the objects with that id are visited
 		std::vector<Body*> GetObjects(int id);
 		void RemoveObjects(int id);
 
@@ -140,19 +818,225 @@ namespace cl
 		// world. For example, if the difference between the goal and current horizontal
 		// position was 10 and we did 2 steps, we would go 5 pixels left, check for collision,
 		// go another 5 pixels left and then check for collision again. More checks = more precise
-		// but also takes more CPU time.
+		// but also takes more CPU time. The function gets the body stored in this world so it
+		// can modify or remove it (but it mustnt add new objects to the world).
+		// The objects are checked in the order of their handles, so the result is the same for every
+		// BroadPhase and quadtree capacity (it used to depend on the order the quadtree returned them in).
 		Point Check(int steps, Rect body, Point goal, std::function<void(Body&, World*)> func = nullptr);
 
-		// get the instance of the quadtree
-		inline QuadTree& Tree() { return m_tree; }
+		// Same as Check() but func can be anything that can be called as func(Body&, World*) (a lambda, a functor, ...) -
+		// it is called directly (so it can be inlined) instead of thru std::function. If you pass NoCallback() or nullptr,
+		// the code that calls it is removed completely.
+		template<typename Callback>
+		Point Check(int steps, Rect body, Point goal, Callback func);
+		inline Point Check(int steps, Rect body, Point goal, std::nullptr_t) { return Check(steps, body, goal, NoCallback()); }
+
+		// Same as Check() with a Rect, but only the objects that body.CollidesWith() are checked (the body doesnt
+		// have to be in the world, only its Bounds and layers are used)
+		Point Check(int steps, const Body& body, Point goal, std::function<void(Body&, World*)> func = nullptr);
+		template<typename Callback>
+		Point Check(int steps, const Body& body, Point goal, Callback func);
+		inline Point Check(int steps, const Body& body, Point goal, std::nullptr_t) { return Check(steps, body, goal, NoCallback()); }
+
+		// Continuous version of Check() - moves the body to the goal in one go, stops it at the first solid object
+		// in its way and lets it slide along that object, so fast objects cant go thru thin walls no matter how far
+		// they move. Objects the body is already inside of dont stop it. func is called once for every object
+		// the body touches, in the order it touches them.
+		Point Sweep(Rect body, Point goal, std::function<void(Body&, World*)> func = nullptr);
+		Point Sweep(const Body& body, Point goal, std::function<void(Body&, World*)> func = nullptr);
+
+		// Check collision for many objects at once - results[i] is the same position Check(steps, bodies[i], goals[i])
+		// would return. Objects that are close to each other share a single quadtree query and no memory is
+		// allocated once the internal buffers have grown. The function also gets the index of the object.
+		void CheckMany(int steps, const Rect* bodies, const Point* goals, Point* results, size_t count, std::function<void(size_t, Body&, World*)> func = nullptr);
+
+		// Same as CheckMany but the objects are split between the threads of the given pool. The results
+		// are the same as with the single threaded version. The function is called after all the
+		// objects have been checked (on the calling thread) - ordered by the object index and then
+		// by the order of the hits, so the changes it makes to the world dont affect the other objects.
+		void CheckMany(ThreadPool& pool, int steps, const Rect* bodies, const Point* goals, Point* results, size_t count, std::function<void(size_t, Body&, World*)> func = nullptr);
+
+		// Get every pair of overlapping objects in the world - A is always an object of type typeA and B is
+		// of type typeB. For example, (Cross, Solid) gives all the pick ups touching a solid object.
+		// Each pair is returned only once.
+		void FindOverlappingPairs(std::vector<BodyPair>& pairs, CollisionType typeA = CollisionType::Solid, CollisionType typeB = CollisionType::Solid);
+
+		// get the structure used to find the nearby bodies (the one that holds the objects that arent static)
+		inline BroadPhase& GetBroadPhase() { return *m_broadPhase; }
+
+		// get the instance of the quadtree (only if the world was created with BroadPhaseType::QuadTree)
+		inline QuadTree& Tree() { return static_cast<QuadTree&>(*m_broadPhase); }
+
+		// get the instance of the spatial hash (only if the world was created with BroadPhaseType::SpatialHash)
+		inline SpatialHash& Hash() { return static_cast<SpatialHash&>(*m_broadPhase); }
 
 	private:
-		// calculate min and max of element position
-		Rect m_getBounds();
+		// max number of objects that can share a quadtree query in CheckMany
+		static constexpr size_t BatchGroupSize = 16;
+
+		// add a body to the list and to the static tree or the BroadPhase
+		BodyHandle m_add(const Body& body, bool isStatic);
+
+		// bodies pushed through GetObjects() dont have the per-body state yet - add them as dynamic objects. Returns true
+		// if bodies were removed from the end of GetObjects() (the trees and the lists of ids have to be built again)
+		bool m_syncBodies();
+
+		// insert all alive dynamic/static objects into an empty BroadPhase/static tree
+		void m_buildBroadPhase();
+		void m_buildStaticTree();
+
+		// add/remove an object to/from the list of objects with its id + build all the lists again
+		void m_addId(BodyHandle handle);
+		void m_removeId(BodyHandle handle);
+		void m_buildIds();
+
+		// calculate min and max of element position (static objects arent included)
+		Rect m_getBounds() const;
+
+		// get the objects in a given range (in one of the layers of mask) from both the static tree and the BroadPhase
+		void m_query(const Box& bnd, uint32_t mask, std::vector<BodyHandle>& bodies) const;
+
+		// the region in which a body moving from bounds to goal can hit something
+		Rect m_checkRegion(const Rect& bounds, Point goal) const;
+
+		// get the bodies a body (with the given layers) moving from bounds to goal can hit - in the order they were added
+		void m_checkCandidates(const Rect& bounds, uint32_t category, uint32_t mask, Point goal, std::vector<BodyHandle>& bodies) const;
+
+		// Check() and Sweep() for a body with the given layers
+		template<typename Callback>
+		Point m_check(int steps, Rect bounds, uint32_t category, uint32_t mask, Point goal, Callback func);
+		Point m_sweep(Rect bounds, uint32_t category, uint32_t mask, Point goal, const std::function<void(Body&, World*)>& func);
+
+		// copy the bounds of the candidates to the buffers of this thread / get a bit for each of the candidates
+		// [first, first + CandidateWidth) that overlaps the mover (SSE/AVX are used if the CPU supports them)
+		static constexpr size_t CandidateWidth = 8;
+		void m_fillCandidates(const std::vector<BodyHandle>& bodies) const;
+		unsigned int m_candidateMask(size_t first, const Box& mover) const;
+
+		// move the body towards the goal and resolve the collisions with the given candidates - onHit(handle) is called for each hit.
+		// If refresh is true, onHit might change the bodies so the candidates are read again after every hit
+		template<typename Callback>
+		Point m_resolve(int steps, Rect bounds, Point goal, const std::vector<BodyHandle>& bodies, bool refresh, Callback onHit);
+
+		// the candidates of a Check() - the list is taken from a pool that each thread has, so Check() doesnt
+		// allocate memory once the lists are big enough (every nested Check() from a callback gets its own list)
+		struct CandidateList
+		{
+			CandidateList();
+			~CandidateList();
+			CandidateList(const CandidateList&) = delete;
+			CandidateList& operator=(const CandidateList&) = delete;
+
+			std::vector<BodyHandle>& Bodies;
+		};
+
+		// buffers used to check a group of objects in CheckMany (each thread has its own)
+		struct BatchScratch
+		{
+			std::vector<BodyHandle> Group, Candidates, Events;
+		};
+
+		// objects [Begin, End) of the sorted list that share a quadtree query with the given bounds
+		struct BatchGroup
+		{
+			size_t Begin, End;
+			Box Bounds;
+		};
+
+		// hits of a single object in a multithreaded CheckMany
+		struct BatchEvents
+		{
+			unsigned int Thread;
+			size_t First, Count;
+		};
 
-		// linear list of all elements + list of elements organized in a quad tree
-		QuadTree m_tree;
+		// calculate the check regions and split the objects into groups of nearby objects
+		void m_prepareBatch(const Rect* bodies, const Point* goals, size_t count);
+
+		// check all the objects in a group - onHit(index, handle) is called for each hit (refresh is passed to m_resolve)
+		template<typename Callback>
+		void m_checkGroup(size_t group, int steps, const Rect* bodies, const Point* goals, Point* results, BatchScratch& scratch, bool refresh, Callback onHit);
+
+		// linear list of all elements + list of elements organized in a quad tree (or some other structure)
 		std::vector<Body> m_bodies;
+		std::unique_ptr<BroadPhase> m_broadPhase;
+		BroadPhaseType m_broadPhaseType;
+
+		// static objects + the tree they are stored in
+		std::vector<bool> m_static;
+		size_t m_staticCount;
+		std::unique_ptr<PackedTree> m_staticTree;
+
+		// which bodies are still in the world, which handles can be reused and how many times each handle was freed
+		std::vector<bool> m_alive;
+		std::vector<BodyHandle> m_freeHandles;
+		std::vector<unsigned int> m_generations;
+
+		// the id each object was added to the lists with and its position in that list
+		struct IdSlot
+		{
+			int Id;
+			unsigned int Position;
+		};
+
+		// handles of the objects with each id (an object is removed by moving the last handle in the list to its place)
+		std::unordered_map<int, std::vector<BodyHandle>> m_ids;
+		std::vector<IdSlot> m_idSlots;
+
+		// buffers reused by CheckMany - check regions, objects sorted by position, groups (ranges in the sorted list),
+		// query results and hits
+		std::vector<Box> m_batchRegions;
+		std::vector<std::pair<unsigned int, size_t>> m_batchOrder;
+		std::vector<BatchGroup> m_batchGroups;
+		std::vector<BatchScratch> m_batchScratch;
+		std::vector<BatchEvents> m_batchEvents;
+	};
+
+
+
+	/*
+		CollisionFilter holds the function that tells GridWorld the CollisionType of each
+		tile ID. By default the function is called for every tile that Check(), Sweep() and
+		Raycast() look at, so it can depend on anything (a door that opens, a timer, ...).
+		If the function always gives the same type for the same ID, call SetPure(true) after
+		assigning it - GridWorld then keeps the types in a lookup table and skips the tiles
+		that are CollisionType::None. The filter counts how many times it was changed, so
+		that GridWorld knows when it has to rebuild the table.
+	*/
+	class CollisionFilter
+	{
+	public:
+		CollisionFilter() : m_version(0), m_pure(false) {}
+
+		// assigning a new function also marks it as not pure
+		inline CollisionFilter& operator=(std::function<CollisionType(int)> func) { m_func = func; m_pure = false; m_version++; return *this; }
+		inline CollisionType operator()(int id) const { return m_func(id); }
+		inline unsigned int GetVersion() const { return m_version; }
+
+		// tell GridWorld if the types of the IDs can be cached (the function only depends on the ID)
+		inline void SetPure(bool pure) { m_pure = pure; m_version++; }
+		inline bool IsPure() const { return m_pure; }
+
+	private:
+		std::function<CollisionType(int)> m_func;
+		unsigned int m_version;
+		bool m_pure;
+	};
+
+
+
+	/*
+		GridRaycastHit describes the first tile hit by GridWorld::Raycast(). Fraction tells how
+		far along the ray the tile was hit (0 = start, 1 = end), Position is the point where
+		it was hit and Normal points out of the side of the tile that was hit (it is (0, 0)
+		if the ray starts inside of the tile).
+	*/
+	struct GridRaycastHit
+	{
+		int X, Y, Id;
+		float Fraction;
+		Point Position;
+		Point Normal;
 	};
 
 
@@ -163,32 +1047,631 @@ namespace cl
 		It should be used in tile worlds. GridWorld doesnt use QuadTree and it doesnt
 		use cl::Body class. It only needs a 2D array of tile IDs and a function GetCollisionType
 		which tells it whether a tile is CollisionType::Solid, CollisionType::Cross, etc...
+		Tiles are stored in one array (row by row) as TileType - use GridWorld8 or GridWorld16
+		if your tile IDs fit in 8 or 16 bits to save memory on large maps. If the filter is
+		pure (read the CollisionFilter comment), collision types are cached in a table indexed
+		by tile ID which is rebuilt when the filter changes. Each row also has a bit mask of
+		tiles that arent CollisionType::None, so Check() can skip empty tiles 64 at a time.
+		Check() only looks at the cells the body touches.
 	*/
-	class GridWorld
+	template<typename TileType>
+	class BasicGridWorld
 	{
 	public:
+		BasicGridWorld();
+
 		// create a grid world with given width and height and cell size
 		void Create(int width, int height, int cellW, int cellH);
 
 		// set/get object on a given position
-		inline void SetObject(int x, int y, int id) { m_grid[y][x] = id; }
-		inline int GetObject(int x, int y) { return m_grid[y][x]; }
+		inline void SetObject(int x, int y, int id)
+		{
+			TileType tile = (TileType)id;
+			m_tiles[(size_t)y * m_w + x] = tile;
+			if ((unsigned int)tile >= m_tableSize)
+				m_growTable(tile);
+
+			uint64_t bit = 1ULL << (x & 63);
+			uint64_t& word = m_mask[(size_t)y * m_rowWords + (x >> 6)];
+			word = m_canHit(tile) ? (word | bit) : (word & ~bit);
+		}
+		inline int GetObject(int x, int y) { return m_tiles[(size_t)y * m_w + x]; }
+
+		// save the tiles to a file / load them (like Create(), this resets the filter) - Load() returns false and
+		// doesnt change anything if the file is missing, truncated, corrupted or stores a different tile type
+		bool Save(const std::string& filename) const;
+		bool Load(const std::string& filename);
+
+		// get world size
+		inline int GetWidth() { return m_w; }
+		inline int GetHeight() { return m_h; }
+
+		// Check for collision between player and the grid world.
+		// NOTE: read World::Check() comment to read about the "steps" parameter
+		Point Check(int steps, Rect body, Point goal, std::function<void(int, int, int, bool, BasicGridWorld*)> func = nullptr);
+
+		// Same as Check() but func can be anything that can be called as func(id, x, y, xAxis, BasicGridWorld*) -
+		// read the comment of the templated World::Check()
+		template<typename Callback>
+		Point Check(int steps, Rect body, Point goal, Callback func);
+		inline Point Check(int steps, Rect body, Point goal, std::nullptr_t) { return Check(steps, body, goal, NoCallback()); }
+
+		// Continuous version of Check() - read World::Sweep() comment. The bool passed to func tells whether the
+		// tile was hit while moving along the x axis.
+		Point Sweep(Rect body, Point goal, std::function<void(int, int, int, bool, BasicGridWorld*)> func = nullptr);
+
+		// find the first tile of the given type on the line from -> to (line of sight checks, bullets, etc...).
+		// Only the cells the line goes thru are checked, in order, so it stops as soon as something is hit
+		bool Raycast(Point from, Point to, GridRaycastHit& hit, CollisionType type = CollisionType::Solid);
+
+		// a "filter" which tells us certain CollisionType for each tile ID
+		CollisionFilter GetCollisionType;
+
+	private:
+		// largest number of entries in the lookup table (IDs after that go through the filter)
+		static constexpr unsigned int MaxTableSize = 65536;
+
+		// get the collision type of a tile ID (the table is empty if the filter isnt pure)
+		inline CollisionType m_getType(int id) const { return (unsigned int)id < m_types.size() ? m_types[id] : GetCollisionType(id); }
+
+		// can a tile be hit - a filter that isnt pure can give a different type on every call, so it can hit any tile
+		inline bool m_canHit(int id) const { return !GetCollisionType.IsPure() || m_getType(id) != CollisionType::None; }
+
+		// fill the lookup table using the current filter (clear it if the filter isnt pure)
+		void m_buildTable(size_t size);
+
+		// make the lookup table big enough to store the given ID
+		void m_growTable(int id);
+
+		// set the bits of all the tiles that can be hit
+		void m_buildMask();
+
+		// get the first tile in a row (given its mask) in [x, end] that can be hit, end + 1 if there isnt any
+		int m_nextTile(const uint64_t* mask, int x, int end) const;
+
+		// get the cells the given bounds might touch (limited to the given region)
+		void m_getRange(const Rect& bounds, const Rect& region, int& fromX, int& fromY, int& toX, int& toY) const;
+
+		int m_w, m_h, m_cellW, m_cellH;
+		std::vector<TileType> m_tiles;
+
+		// collision type of each tile ID (empty if the filter isnt pure) + number of IDs it stores when the filter
+		// is pure + version of the filter that was used to fill it
+		std::vector<CollisionType> m_types;
+		size_t m_tableSize;
+		unsigned int m_typesVersion;
+
+		// a bit for each tile, set if the tile can be hit + number of 64 bit words per row
+		std::vector<uint64_t> m_mask;
+		int m_rowWords;
+	};
+
+	typedef BasicGridWorld<int> GridWorld;
+	typedef BasicGridWorld<uint8_t> GridWorld8;
+	typedef BasicGridWorld<uint16_t> GridWorld16;
+
+
+
+	/*
+		MappedFile maps a whole file into memory (read only). The operating system only
+		loads the parts of the file that are actually read, so it can be used for files
+		that are bigger than the available memory.
+	*/
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		// map a file - returns false if the file couldnt be opened or mapped
+		bool Open(const std::string& filename);
+		void Close();
+
+		// exchange the mapped files of two objects
+		void Swap(MappedFile& other);
+
+		inline const unsigned char* GetData() const { return m_data; }
+		inline size_t GetSize() const { return m_size; }
+		inline bool IsOpen() const { return m_data != nullptr; }
+
+	private:
+		const unsigned char* m_data;
+		size_t m_size;
+
+#ifdef _WIN32
+		void* m_file;
+		void* m_mapping;
+#else
+		int m_file;
+#endif
+	};
+
+
+
+	/*
+		ChunkedGridWorld works like GridWorld but it doesnt store the whole map. The map is
+		split into ChunkSize x ChunkSize chunks that are loaded when Check(), GetObject() or
+		SetObject() first needs them - either from LoadChunk (for example a map generator)
+		or from a file opened with Map(). Chunks that havent been used for the longest
+		time are dropped once the loaded chunks take more memory than the budget (modified
+		chunks are passed to SaveChunk first, or kept if SaveChunk isnt set). Chunks where
+		all tile IDs are 0 dont store any tiles.
+	*/
+	template<typename TileType>
+	class BasicChunkedGridWorld
+	{
+	public:
+		// width and height of a chunk in tiles + the default memory budget
+		static constexpr int ChunkSize = 64;
+		static constexpr size_t DefaultMemoryBudget = 64 * 1024 * 1024;
+
+		BasicChunkedGridWorld();
+
+		// LoadChunk points to this world when Map() is used
+		BasicChunkedGridWorld(const BasicChunkedGridWorld&) = delete;
+		BasicChunkedGridWorld& operator=(const BasicChunkedGridWorld&) = delete;
+
+		// create a grid world with given width and height and cell size (doesnt load anything)
+		void Create(int width, int height, int cellW, int cellH);
+
+		// load the tiles from a file saved with GridWorld::Save() (with the same size and tile type) or from a
+		// file which only stores width x height tiles row by row - call after Create(). Only the size of the
+		// file is checked (checking the checksum would mean reading the whole file).
+		bool Map(const std::string& filename);
+
+		// set/get object on a given position
+		void SetObject(int x, int y, int id);
+		int GetObject(int x, int y);
 
 		// get world size
 		inline int GetWidth() { return m_w; }
 		inline int GetHeight() { return m_h; }
 
+		// how much memory can the loaded chunks take (in bytes) and how much do they take right now
+		inline void SetMemoryBudget(size_t bytes) { m_budget = bytes; m_evict(nullptr); }
+		inline size_t GetMemoryBudget() const { return m_budget; }
+		inline size_t GetMemoryUsage() const { return m_memory; }
+
+		// pass all modified chunks to SaveChunk
+		void Flush();
+
 		// Check for collision between player and the grid world.
 		// NOTE: read World::Check() comment to read about the "steps" parameter
-		Point Check(int steps, Rect body, Point goal, std::function<void(int, int, int, bool, GridWorld*)> func = nullptr);
+		Point Check(int steps, Rect body, Point goal, std::function<void(int, int, int, bool, BasicChunkedGridWorld*)> func = nullptr);
+
+		// Same as Check() but func can be anything that can be called as func(id, x, y, xAxis, BasicChunkedGridWorld*) -
+		// read the comment of the templated World::Check()
+		template<typename Callback>
+		Point Check(int steps, Rect body, Point goal, Callback func);
+		inline Point Check(int steps, Rect body, Point goal, std::nullptr_t) { return Check(steps, body, goal, NoCallback()); }
+
+		// Continuous version of Check() - read World::Sweep() comment
+		Point Sweep(Rect body, Point goal, std::function<void(int, int, int, bool, BasicChunkedGridWorld*)> func = nullptr);
+
+		// read GridWorld::Raycast() comment - only the chunks the line goes thru are loaded
+		bool Raycast(Point from, Point to, GridRaycastHit& hit, CollisionType type = CollisionType::Solid);
 
 		// a "filter" which tells us certain CollisionType for each tile ID
-		std::function<CollisionType(int)> GetCollisionType; 
+		CollisionFilter GetCollisionType;
+
+		// fill the tiles of a chunk (row by row, all tiles are 0 when called) - return false if the chunk is empty
+		std::function<bool(int chunkX, int chunkY, TileType* tiles)> LoadChunk;
+
+		// store a modified chunk before it is dropped
+		std::function<void(int chunkX, int chunkY, const TileType* tiles)> SaveChunk;
 
 	private:
+		// largest number of entries in the lookup table (IDs after that go through the filter)
+		static constexpr unsigned int MaxTableSize = 65536;
+
+		// a loaded chunk - Tiles and Mask (a bit for each tile that can be hit, a word
+		// per row) are empty if all the tiles are 0
+		struct Chunk
+		{
+			std::vector<TileType> Tiles;
+			std::vector<uint64_t> Mask;
+			unsigned int MaskVersion;
+			bool Modified;
+			std::list<unsigned long long>::iterator Used;
+		};
+
+		// get the collision type of a tile ID (the table is empty if the filter isnt pure)
+		inline CollisionType m_getType(int id) const { return (unsigned int)id < m_types.size() ? m_types[id] : GetCollisionType(id); }
+
+		// can a tile be hit - a filter that isnt pure can give a different type on every call, so it can hit any tile
+		inline bool m_canHit(int id) const { return !GetCollisionType.IsPure() || m_getType(id) != CollisionType::None; }
+
+		// fill the lookup table using the current filter (clear it if the filter isnt pure)
+		void m_buildTable(size_t size);
+
+		// get a chunk, load it if it isnt loaded
+		Chunk& m_getChunk(int chunkX, int chunkY);
+
+		// set the bits of all the tiles in a chunk that can be hit
+		void m_buildMask(Chunk& chunk);
+
+		// how much memory does a chunk take
+		size_t m_chunkMemory(const Chunk& chunk) const;
+
+		// drop the least recently used chunks until we fit in the budget (keep always is never dropped)
+		void m_evict(const Chunk* keep);
+
+		// drop all the chunks
+		void m_reset();
+
+		// get the first tile in row y in [x, end] that can be hit, end + 1 if there isnt any
+		int m_nextTile(int y, int x, int end);
+
+		// get the cells the given bounds might touch (limited to the given region)
+		void m_getRange(const Rect& bounds, const Rect& region, int& fromX, int& fromY, int& toX, int& toY) const;
+
 		int m_w, m_h, m_cellW, m_cellH;
-		std::vector<std::vector<int>> m_grid;
+
+		// loaded chunks + their keys, the most recently used one first
+		std::unordered_map<unsigned long long, Chunk, CellHash> m_chunks;
+		std::list<unsigned long long> m_used;
+
+		// the last chunk we got (so that we dont have to look it up for every tile)
+		unsigned long long m_lastKey;
+		Chunk* m_lastChunk;
+
+		// memory budget and memory used by the loaded chunks
+		size_t m_budget, m_memory;
+
+		// collision type of each tile ID (empty if the filter isnt pure) + number of IDs it stores when the filter
+		// is pure + version of the filter that was used to fill it
+		std::vector<CollisionType> m_types;
+		size_t m_tableSize;
+		unsigned int m_typesVersion;
+
+		// file opened with Map()
+		MappedFile m_file;
 	};
+
+	typedef BasicChunkedGridWorld<int> ChunkedGridWorld;
+	typedef BasicChunkedGridWorld<uint8_t> ChunkedGridWorld8;
+	typedef BasicChunkedGridWorld<uint16_t> ChunkedGridWorld16;
+
+
+
+
+	/*
+		The templated functions - they have to be in the header so that they can be compiled with
+		any function object.
+	*/
+	template<typename Callback>
+	Point World::Check(int steps, Rect bounds, Point goal, Callback func)
+	{
+		return m_check(steps, bounds, AllCategories, AllCategories, goal, func);
+	}
+	template<typename Callback>
+	Point World::Check(int steps, const Body& body, Point goal, Callback func)
+	{
+		return m_check(steps, body.Bounds, body.Category, body.Mask, goal, func);
+	}
+	template<typename Callback>
+	Point World::m_check(int steps, Rect bounds, uint32_t category, uint32_t mask, Point goal, Callback func)
+	{
+		COLLY_PROFILE_SCOPE("World::Check");
+
+		// get only the bodies we have to check collision with - in the order they were added
+		// so that the result doesnt depend on the layout of the tree
+		CandidateList candidates;
+		std::vector<BodyHandle>& bodies = candidates.Bodies;
+		m_checkCandidates(bounds, category, mask, goal, bodies);
+
+		// the function might change the bodies - if there is one, the candidates are read again after every call
+		COLLY_PROFILE_SCOPE("World::Check/Resolve");
+		const bool hasCallback = !std::is_same<Callback, NoCallback>::value;
+		return m_resolve(steps, bounds, goal, bodies, hasCallback, [&](BodyHandle handle) {
+			if (hasCallback) {
+				COLLY_STAT(CallbackInvocations, 1);
+				func(m_bodies[handle], this);
+			}
+		});
+	}
+	template<typename Callback>
+	Point World::m_resolve(int steps, Rect bounds, Point goal, const std::vector<BodyHandle>& bodies, bool refresh, Callback onHit)
+	{
+		Rect intersect;
+
+		// the increment per axis for each step
+		float xInc = (goal.X - bounds.X) / steps;
+		float yInc = (goal.Y - bounds.Y) / steps;
+
+		// copy the bounds of the candidates to separate arrays so that we can test a few of them at once
+		m_fillCandidates(bodies);
+
+		// go thru the bodies that intersect with ours (in order) until we hit a solid body that pushes
+		// us back on the given axis (0 = x, 1 = y)
+		auto resolveAxis = [&](int axis) {
+			COLLY_STAT(IntersectionTests, bodies.size());
+			Box mover(bounds);
+			for (size_t first = 0; first < bodies.size(); first += CandidateWidth) {
+				unsigned int mask = m_candidateMask(first, mover);
+				for (size_t lane = 0; (mask >> lane) != 0; lane++) {
+					if (((mask >> lane) & 1) == 0)
+						continue;
+
+					BodyHandle handle = bodies[first + lane];
+					Body& b = m_bodies[handle];
+					b.Bounds.Intersects(bounds, intersect);
+
+					// call the user function - if it changed the bodies, read them again
+					onHit(handle);
+					if (refresh) {
+						m_fillCandidates(bodies);
+						mask = m_candidateMask(first, mover);
+					}
+
+					// only check for collision if we encountered a solid object
+					if (b.Type != CollisionType::Solid)
+						continue;
+
+					float xInter = intersect.Width;
+					float yInter = intersect.Height;
+
+					if (axis == 0 && xInter < yInter) {
+						if (bounds.X < b.Bounds.X)
+							xInter *= -1; // bounce in the direction that depends on the body and user position
+
+						bounds.X += xInter; // move the user back
+						COLLY_STAT(SolidResolutions, 1);
+						return;
+					}
+					if (axis == 1 && yInter < xInter) {
+						if (bounds.Y < b.Bounds.Y)
+							yInter *= -1;
+
+						bounds.Y += yInter;
+						COLLY_STAT(SolidResolutions, 1);
+						return;
+					}
+				}
+			}
+		};
+
+		// go thru each step - increment along x axis and check for collision, then repeat everything for Y axis
+		for (int i = 0; i < steps; i++) {
+			bounds.X += xInc;
+			resolveAxis(0);
+
+			bounds.Y += yInc;
+			resolveAxis(1);
+		}
+
+		return { bounds.X, bounds.Y };
+	}
+	template<typename TileType>
+	template<typename Callback>
+	Point BasicGridWorld<TileType>::Check(int steps, Rect bounds, Point goal, Callback func)
+	{
+		COLLY_PROFILE_SCOPE("GridWorld::Check");
+		const bool hasCallback = !std::is_same<Callback, NoCallback>::value;
+		Rect intersect;
+
+		// the filter was changed - update the lookup table and the masks
+		if (GetCollisionType.GetVersion() != m_typesVersion) {
+			m_buildTable(m_tableSize);
+			m_buildMask();
+		}
+
+		// the increment per axis for each step
+		float xInc = (goal.X - bounds.X) / steps;
+		float yInc = (goal.Y - bounds.Y) / steps;
+
+		// calculate subregion that needs to be checked
+		Rect checkRegion(std::min(goal.X, bounds.X), std::min(goal.Y, bounds.Y), std::max(goal.X, bounds.X + bounds.Width), std::max(goal.Y, bounds.Y + bounds.Height));
+		checkRegion.X = std::max(0, (int)(checkRegion.X - bounds.Width) / m_cellW);
+		checkRegion.Y = std::max(0, (int)(checkRegion.Y - bounds.Height) / m_cellH);
+		checkRegion.Width = std::min((int)(checkRegion.Width + bounds.Width) / m_cellW, m_w - 1);
+		checkRegion.Height = std::min((int)(checkRegion.Height + bounds.Height) / m_cellH, m_h - 1);
+
+		int fromX, fromY, toX, toY;
+		for (int i = 0; i < steps; i++) {
+			// increment along x axis and check for collision - only the tiles that arent CollisionType::None and that
+			// are under the body are visited (in the same order as if we went through the whole region)
+			bounds.X += xInc;
+			m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+			for (int y = fromY; y <= toY; y++) {
+				const TileType* row = &m_tiles[(size_t)y * m_w];
+				const uint64_t* mask = &m_mask[(size_t)y * m_rowWords];
+				for (int x = m_nextTile(mask, fromX, toX); x <= toX; x = m_nextTile(mask, x + 1, toX)) {
+					int id = row[x];
+					CollisionType type = m_getType(id); // fetch the collision type from the table (filled using GetCollisionType)
+
+					if (type == CollisionType::None) // no collision checking needed? just skip the body
+						continue;
+
+					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+					COLLY_STAT(IntersectionTests, 1);
+
+					if (cell.Intersects(bounds, intersect)) {
+						// call the user function
+						if (hasCallback) {
+							COLLY_STAT(CallbackInvocations, 1);
+							func(id, x, y, true, this);
+						}
+
+						// only check for collision if we encountered a solid object
+						if (type != CollisionType::Solid)
+							continue;
+
+						float xInter = intersect.Width;
+						float yInter = intersect.Height;
+
+						if (xInter < yInter) {
+							if (bounds.X < cell.X)
+								xInter *= -1; // "bounce" in the direction that depends on the body and user position
+
+							bounds.X += xInter; // move the user back
+							m_getRange(bounds, checkRegion, fromX, fromY, toX, toY); // and update the cells it touches
+							COLLY_STAT(SolidResolutions, 1);
+
+							break;
+						}
+					}
+				}
+			}
+
+			// increment along y axis and check for collision - repeat everything for Y axis
+			bounds.Y += yInc;
+			m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+			for (int y = fromY; y <= toY; y++) {
+				const TileType* row = &m_tiles[(size_t)y * m_w];
+				const uint64_t* mask = &m_mask[(size_t)y * m_rowWords];
+				for (int x = m_nextTile(mask, fromX, toX); x <= toX; x = m_nextTile(mask, x + 1, toX)) {
+					int id = row[x];
+					CollisionType type = m_getType(id);
+
+					if (type == CollisionType::None)
+						continue;
+
+					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+					COLLY_STAT(IntersectionTests, 1);
+
+					if (cell.Intersects(bounds, intersect)) {
+						if (hasCallback) {
+							COLLY_STAT(CallbackInvocations, 1);
+							func(id, x, y, false, this);
+						}
+
+						if (type == CollisionType::Cross)
+							continue;
+
+						float xInter = intersect.Width;
+						float yInter = intersect.Height;
+
+						if (yInter < xInter) {
+							if (bounds.Y < cell.Y)
+								yInter *= -1;
+
+							bounds.Y += yInter;
+							m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+							COLLY_STAT(SolidResolutions, 1);
+
+							break;
+						}
+					}
+				}
+			}
+
+		}
+
+		return { bounds.X, bounds.Y };
+	}
+	template<typename TileType>
+	template<typename Callback>
+	Point BasicChunkedGridWorld<TileType>::Check(int steps, Rect bounds, Point goal, Callback func)
+	{
+		COLLY_PROFILE_SCOPE("ChunkedGridWorld::Check");
+		const bool hasCallback = !std::is_same<Callback, NoCallback>::value;
+		Rect intersect;
+
+		// the filter was changed - update the lookup table (masks of the chunks are updated when we get them)
+		if (GetCollisionType.GetVersion() != m_typesVersion)
+			m_buildTable(m_tableSize);
+
+		// the increment per axis for each step
+		float xInc = (goal.X - bounds.X) / steps;
+		float yInc = (goal.Y - bounds.Y) / steps;
+
+		// calculate subregion that needs to be checked
+		Rect checkRegion(std::min(goal.X, bounds.X), std::min(goal.Y, bounds.Y), std::max(goal.X, bounds.X + bounds.Width), std::max(goal.Y, bounds.Y + bounds.Height));
+		checkRegion.X = std::max(0, (int)(checkRegion.X - bounds.Width) / m_cellW);
+		checkRegion.Y = std::max(0, (int)(checkRegion.Y - bounds.Height) / m_cellH);
+		checkRegion.Width = std::min((int)(checkRegion.Width + bounds.Width) / m_cellW, m_w - 1);
+		checkRegion.Height = std::min((int)(checkRegion.Height + bounds.Height) / m_cellH, m_h - 1);
+
+		// same as GridWorld::Check() except that the tiles come from the chunks (which are loaded when needed)
+		int fromX, fromY, toX, toY;
+		for (int i = 0; i < steps; i++) {
+			// increment along x axis and check for collision
+			bounds.X += xInc;
+			m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+			for (int y = fromY; y <= toY; y++) {
+				for (int x = m_nextTile(y, fromX, toX); x <= toX; x = m_nextTile(y, x + 1, toX)) {
+					int id = GetObject(x, y);
+					CollisionType type = m_getType(id);
+
+					if (type == CollisionType::None)
+						continue;
+
+					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+					COLLY_STAT(IntersectionTests, 1);
+
+					if (cell.Intersects(bounds, intersect)) {
+						if (hasCallback) {
+							COLLY_STAT(CallbackInvocations, 1);
+							func(id, x, y, true, this);
+						}
+
+						if (type != CollisionType::Solid)
+							continue;
+
+						float xInter = intersect.Width;
+						float yInter = intersect.Height;
+
+						if (xInter < yInter) {
+							if (bounds.X < cell.X)
+								xInter *= -1;
+
+							bounds.X += xInter;
+							m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+							COLLY_STAT(SolidResolutions, 1);
+
+							break;
+						}
+					}
+				}
+			}
+
+			// increment along y axis and check for collision
+			bounds.Y += yInc;
+			m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+			for (int y = fromY; y <= toY; y++) {
+				for (int x = m_nextTile(y, fromX, toX); x <= toX; x = m_nextTile(y, x + 1, toX)) {
+					int id = GetObject(x, y);
+					CollisionType type = m_getType(id);
+
+					if (type == CollisionType::None)
+						continue;
+
+					Rect cell(x*m_cellW, y*m_cellH, m_cellW, m_cellH);
+					COLLY_STAT(IntersectionTests, 1);
+
+					if (cell.Intersects(bounds, intersect)) {
+						if (hasCallback) {
+							COLLY_STAT(CallbackInvocations, 1);
+							func(id, x, y, false, this);
+						}
+
+						if (type == CollisionType::Cross)
+							continue;
+
+						float xInter = intersect.Width;
+						float yInter = intersect.Height;
+
+						if (yInter < xInter) {
+							if (bounds.Y < cell.Y)
+								yInter *= -1;
+
+							bounds.Y += yInter;
+							m_getRange(bounds, checkRegion, fromX, fromY, toX, toY);
+							COLLY_STAT(SolidResolutions, 1);
+
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		return { bounds.X, bounds.Y };
+	}
 }
 
-#endif
\ No newline at end of file
+#endif
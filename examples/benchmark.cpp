@@ -0,0 +1,926 @@
+#include "Colly.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#define WORLD_SIZE 4096	// world width and height in pixels
+#define QUAD_SIZE 24	// size of the largest quad in pixels
+#define REPEAT 50		// how many times each query is repeated
+
+const char* broadPhaseNames[] = { "QuadTree", "SweepAndPrune", "SpatialHash", "PackedTree" };
+
+// time a function in microseconds
+template<typename F>
+double Measure(F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < REPEAT; i++)
+		func();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double, std::micro>(end - start).count() / REPEAT;
+}
+
+// small random number generator (splitmix64) - unlike rand() it gives the same numbers on every platform,
+// so the generated scenes are the same everywhere
+struct Random
+{
+	uint64_t State;
+
+	Random(uint64_t seed) : State(seed) {}
+
+	uint32_t Next()
+	{
+		uint64_t z = (State += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return (uint32_t)((z ^ (z >> 31)) >> 32);
+	}
+
+	// number in [0, max)
+	inline int Int(int max) { return (int)(Next() % (uint32_t)max); }
+	inline float Float(float max) { return (float)Int((int)max); }
+};
+
+// how the bodies are placed - spread over the whole world, packed into a few clusters, along a few long
+// horizontal corridors or on a grid of 16x16 tiles
+enum class Layout { Uniform, Clustered, Corridor, TileMap };
+const char* layoutNames[] = { "uniform", "clustered", "corridor", "tilemap" };
+
+// bodies of a generated scene - the world gets bigger with the number of bodies (about one body
+// per 32x32 pixels), so the density is the same for all the sizes
+struct Scene
+{
+	float Size;
+	std::vector<cl::Rect> Bodies;
+};
+Scene GenerateScene(Layout layout, int count, uint64_t seed)
+{
+	Random random(seed);
+	Scene scene;
+	scene.Size = std::max(256.0f, std::floor(32 * std::sqrt((float)count) / 16) * 16);
+	int size = (int)scene.Size;
+
+	for (int i = 0; i < count; i++) {
+		float x = random.Float(scene.Size), y = random.Float(scene.Size);
+		float w = (float)(1 + random.Int(QUAD_SIZE)), h = (float)(1 + random.Int(QUAD_SIZE));
+		if (layout == Layout::Clustered) {
+			int cluster = random.Int(16);
+			x = (float)((cluster * 977) % (size - size / 16) + random.Int(size / 16));
+			y = (float)((cluster * 541) % (size - size / 16) + random.Int(size / 16));
+		} else if (layout == Layout::Corridor)
+			y = (float)(random.Int(8) * (size / 8) + random.Int(32));
+		else if (layout == Layout::TileMap) {
+			x = (float)(random.Int(size / 16) * 16);
+			y = (float)(random.Int(size / 16) * 16);
+			w = h = 16;
+		}
+
+		scene.Bodies.push_back(cl::Rect(x, y, w, h));
+	}
+	return scene;
+}
+
+// time building the world, moving every object a bit, rebuilding the whole structure, querying around every object
+// and casting rays between the objects
+void CompareBroadPhases(const char* name, const std::vector<cl::Rect>& quads)
+{
+	for (int t = 0; t < 4; t++) {
+		cl::BroadPhaseType type = (cl::BroadPhaseType)t;
+
+		auto start = std::chrono::high_resolution_clock::now();
+		cl::World world(type);
+		for (size_t i = 0; i < quads.size(); i++)
+			world.AddObject((int)i, quads[i], cl::CollisionType::Solid);
+		std::vector<cl::BodyHandle> result;
+		world.Query(cl::Rect(0, 0, 1, 1), result); // sweep and prune and packed tree are built on the first query
+		auto end = std::chrono::high_resolution_clock::now();
+		double build = std::chrono::duration<double, std::milli>(end - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < quads.size(); i++) {
+			cl::Rect bnds = quads[i];
+			bnds.X += (float)((int)(i % 5) - 2);
+			bnds.Y += (float)((int)(i / 5 % 5) - 2);
+			world.MoveObject((cl::BodyHandle)i, bnds);
+		}
+		end = std::chrono::high_resolution_clock::now();
+		double move = std::chrono::duration<double, std::milli>(end - start).count();
+
+		start = std::chrono::high_resolution_clock::now();
+		world.UpdateQuadTree();
+		world.Query(cl::Rect(0, 0, 1, 1), result);
+		end = std::chrono::high_resolution_clock::now();
+		double rebuild = std::chrono::duration<double, std::milli>(end - start).count();
+
+		size_t found = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < quads.size(); i++) {
+			cl::Rect region(quads[i].X - 32, quads[i].Y - 32, 64 + quads[i].Width, 64 + quads[i].Height);
+			result.clear();
+			world.Query(region, result);
+			found += result.size();
+		}
+		end = std::chrono::high_resolution_clock::now();
+		double query = std::chrono::duration<double, std::milli>(end - start).count();
+
+		// line of sight checks between objects
+		size_t hits = 0;
+		cl::RaycastHit hit;
+		start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < quads.size(); i++) {
+			const cl::Rect& a = quads[i];
+			const cl::Rect& b = quads[(i * 7919) % quads.size()];
+			hits += world.Raycast({ a.X - 1, a.Y - 1 }, { b.X - 1, b.Y - 1 }, hit);
+		}
+		end = std::chrono::high_resolution_clock::now();
+		double ray = std::chrono::duration<double, std::milli>(end - start).count();
+
+		printf("%10s %14s %12.1f %12.1f %12.1f %12.1f %12zu %12.1f %12zu\n", name, broadPhaseNames[t], build, move, rebuild, query, found, ray, hits);
+	}
+}
+
+// a level with lots of static walls and a few thousand moving objects - every frame all the moving objects are
+// moved and checked, the world is rebuilt once a second (every 60 frames)
+void BenchmarkStaticSplit(bool split, cl::BroadPhaseType type)
+{
+	srand(77);
+	cl::World world(type);
+	for (int i = 0; i < 100000; i++) {
+		cl::Rect wall((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), (float)(1 + rand() % QUAD_SIZE), (float)(1 + rand() % QUAD_SIZE));
+		if (split)
+			world.AddStaticObject(i, wall, cl::CollisionType::Solid);
+		else
+			world.AddObject(i, wall, cl::CollisionType::Solid);
+	}
+
+	std::vector<cl::BodyHandle> movers;
+	for (int i = 0; i < 2000; i++)
+		movers.push_back(world.AddObject(i, cl::Rect((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 16, 16), cl::CollisionType::Cross));
+
+	double sum = 0, frames = 0, rebuilds = 0;
+	for (int frame = 0; frame < 120; frame++) {
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t i = 0; i < movers.size(); i++) {
+			cl::Rect bnds = world.GetObject(movers[i]).Bounds;
+			cl::Point res = world.Check(2, bnds, { bnds.X + (float)((int)((i + frame) % 7) - 3), bnds.Y + (float)((int)((i * 3 + frame) % 7) - 3) });
+			world.MoveObject(movers[i], cl::Rect(res.X, res.Y, bnds.Width, bnds.Height));
+			sum += res.X + res.Y;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		frames += std::chrono::duration<double, std::milli>(end - start).count();
+
+		if (frame % 60 == 59) {
+			start = std::chrono::high_resolution_clock::now();
+			world.UpdateQuadTree();
+			end = std::chrono::high_resolution_clock::now();
+			rebuilds += std::chrono::duration<double, std::milli>(end - start).count();
+		}
+	}
+
+	printf("%16s %14s %12.1f %12.1f %14.0f\n", split ? "static + dynamic" : "all dynamic", broadPhaseNames[(int)type], frames, rebuilds, sum);
+}
+
+// counts the objects a ray visits
+struct CountVisits : cl::BroadPhase::RayVisitor
+{
+	size_t Count = 0;
+	float Visit(cl::BodyHandle /*handle*/) override { Count++; return 1; }
+};
+
+// the structures used for static objects on their own - building them from scratch, querying the area around
+// random points and casting rays thru the whole level
+template<typename Index>
+void BenchmarkStaticIndex(const char* name, int count)
+{
+	srand(31);
+	std::vector<cl::Body> bodies;
+	for (int i = 0; i < count; i++) {
+		cl::Rect wall((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), (float)(1 + rand() % QUAD_SIZE), (float)(1 + rand() % QUAD_SIZE));
+		bodies.push_back({ i, wall, cl::CollisionType::Solid, nullptr });
+	}
+
+	Index index(bodies);
+	std::vector<cl::BodyHandle> result;
+	auto start = std::chrono::high_resolution_clock::now();
+	index.Reset(cl::Rect(0, 0, WORLD_SIZE + QUAD_SIZE, WORLD_SIZE + QUAD_SIZE));
+	for (int i = 0; i < count; i++)
+		index.Insert((cl::BodyHandle)i);
+	index.Query(cl::Rect(0, 0, 1, 1), result); // the packed tree is built on the first query
+	auto end = std::chrono::high_resolution_clock::now();
+	double build = std::chrono::duration<double, std::milli>(end - start).count();
+
+	size_t found = 0;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < 100000; i++) {
+		result.clear();
+		index.Query(cl::Rect((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 64, 64), result);
+		found += result.size();
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double query = std::chrono::duration<double, std::milli>(end - start).count();
+
+	CountVisits visits;
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < 1000; i++) {
+		cl::Point from = { (float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE) };
+		index.Raycast(from, (float)(rand() % WORLD_SIZE) - from.X, (float)(rand() % WORLD_SIZE) - from.Y, 1, visits);
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double ray = std::chrono::duration<double, std::milli>(end - start).count();
+
+	std::vector<unsigned char> data;
+	index.Save(data);
+
+	printf("%10d %14s %12.1f %12.1f %12zu %12.1f %12zu %12.1f\n", count, name, build, query, found, ray, visits.Count, data.size() / (1024.0 * 1024.0));
+}
+
+// projectiles that only collide with the enemies (about 5% of the bodies) - querying everything and throwing away the
+// other bodies vs letting the broad phase skip them, and Check() with a Rect vs Check() with the projectile's layers
+void BenchmarkLayers(cl::BroadPhaseType type)
+{
+	const uint32_t walls = 1, enemies = 2, projectiles = 4;
+
+	srand(55);
+	cl::World world(type);
+	for (int i = 0; i < 200000; i++) {
+		cl::Rect quad((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), (float)(1 + rand() % QUAD_SIZE), (float)(1 + rand() % QUAD_SIZE));
+		bool enemy = rand() % 20 == 0;
+		world.AddObject({ i, quad, cl::CollisionType::Solid, nullptr, enemy ? enemies : walls, cl::AllCategories });
+	}
+
+	std::vector<cl::BodyHandle> result;
+	size_t found = 0;
+	srand(56);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < 100000; i++) {
+		result.clear();
+		world.Query(cl::Rect((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 64, 64), result);
+		for (cl::BodyHandle handle : result)
+			found += (world.GetObject(handle).Category & enemies) != 0;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double filtered = std::chrono::duration<double, std::milli>(end - start).count();
+
+	size_t foundMask = 0;
+	srand(56);
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < 100000; i++) {
+		result.clear();
+		world.Query(cl::Rect((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 64, 64), result, enemies);
+		foundMask += result.size();
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double masked = std::chrono::duration<double, std::milli>(end - start).count();
+
+	// the projectiles fly far, so the check region is big
+	double times[2], sums[2] = { 0, 0 };
+	for (int layers = 0; layers < 2; layers++) {
+		srand(57);
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < 20000; i++) {
+			cl::Body bullet(0, cl::Rect((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 4, 4), cl::CollisionType::Solid, nullptr, projectiles, enemies);
+			cl::Point goal = { bullet.Bounds.X + (float)(rand() % 256 - 128), bullet.Bounds.Y + (float)(rand() % 256 - 128) };
+			cl::Point res = layers ? world.Check(4, bullet, goal) : world.Check(4, bullet.Bounds, goal);
+			sums[layers] += res.X + res.Y;
+		}
+		end = std::chrono::high_resolution_clock::now();
+		times[layers] = std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	printf("%14s %14.1f %12.1f %12zu %12zu %14.1f %14.1f\n", broadPhaseNames[(int)type], filtered, masked, found, foundMask, times[0], times[1]);
+}
+
+// bodies with NaN positions cant be found by anything and mustnt break the broad phases (the quadtree used
+// to grow forever trying to contain them) - returns false if some broad phase doesnt handle them
+bool CheckInvalidBounds()
+{
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	bool ok = true;
+	for (int t = 0; t < 4; t++) {
+		cl::World world((cl::BroadPhaseType)t);
+		world.AddObject(0, cl::Rect(0, 0, 10, 10), cl::CollisionType::Solid);
+		cl::BodyHandle bad = world.AddObject(1, cl::Rect(nan, 0, 10, 10), cl::CollisionType::Solid);
+		cl::BodyHandle moved = world.AddObject(2, cl::Rect(20, 0, 10, 10), cl::CollisionType::Solid);
+		world.MoveObject(moved, cl::Rect(0, nan, 10, 10));
+		world.MoveObject(bad, cl::Rect(5, 5, 10, 10));
+
+		std::vector<cl::BodyHandle> result;
+		world.Query(cl::Rect(-100, -100, 200, 200), result);
+		if (result.size() != 2) {
+			printf("%s: found %zu bodies instead of 2\n", broadPhaseNames[t], result.size());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// bodies pushed through GetObjects() get the next handles, so adding another object right after them mustnt mix up
+// the handles - returns false if some broad phase loses one of the bodies
+bool CheckPushedBodies()
+{
+	bool ok = true;
+	for (int t = 0; t < 4; t++) {
+		cl::World world((cl::BroadPhaseType)t);
+		world.AddObject(0, cl::Rect(0, 0, 10, 10), cl::CollisionType::Solid);
+		world.GetObjects().push_back(cl::Body(1, cl::Rect(20, 0, 10, 10), cl::CollisionType::Solid));
+		cl::BodyHandle added = world.AddObject(2, cl::Rect(40, 0, 10, 10), cl::CollisionType::Solid);
+		world.MoveObject(added, cl::Rect(40, 20, 10, 10));
+		world.RemoveObject(0);
+
+		std::vector<cl::BodyHandle> result;
+		world.Query(cl::Rect(-100, -100, 200, 200), result);
+		if (added != 2 || result.size() != 2 || world.GetObjects(1).size() != 1 || world.IsStatic(added)) {
+			printf("%s: pushed body got mixed up with an added one\n", broadPhaseNames[t]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// bodies removed from the end of GetObjects() have to disappear from both trees after UpdateQuadTree() - returns false
+// if some broad phase still finds one of them
+bool CheckPoppedBodies()
+{
+	bool ok = true;
+	for (int t = 0; t < 4; t++) {
+		cl::World world((cl::BroadPhaseType)t);
+		world.AddStaticObject(0, cl::Rect(0, 0, 10, 10), cl::CollisionType::Solid);
+		world.AddObject(1, cl::Rect(20, 0, 10, 10), cl::CollisionType::Solid);
+		cl::BodyHandle removed = world.AddObject(2, cl::Rect(40, 0, 10, 10), cl::CollisionType::Solid);
+		cl::BodyRef ref = world.GetRef(world.AddStaticObject(3, cl::Rect(60, 0, 10, 10), cl::CollisionType::Solid));
+		world.RemoveObject(removed);
+		world.GetObjects().pop_back();
+		world.GetObjects().pop_back();
+		world.UpdateQuadTree();
+
+		std::vector<cl::BodyHandle> result;
+		world.Query(cl::Rect(35, -100, 100, 200), result);
+		cl::BodyHandle added = world.AddObject(4, cl::Rect(100, 0, 10, 10), cl::CollisionType::Solid);
+		if (!result.empty() || world.IsValid(ref) || added != 2 || !world.GetObjects(3).empty()) {
+			printf("%s: found a body that was removed from GetObjects()\n", broadPhaseNames[t]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// removing an object twice (or through an old handle) mustnt free its handle twice - returns false if two new objects
+// got the same handle
+bool CheckDoubleRemove()
+{
+	cl::World world;
+	cl::BodyHandle first = world.AddObject(0, cl::Rect(0, 0, 10, 10), cl::CollisionType::Solid);
+	world.RemoveObject(first);
+	world.RemoveObject(first);
+
+	cl::BodyHandle a = world.AddObject(1, cl::Rect(0, 0, 10, 10), cl::CollisionType::Solid);
+	cl::BodyHandle b = world.AddObject(2, cl::Rect(20, 0, 10, 10), cl::CollisionType::Solid);
+	if (a == b || world.GetObjects(1).size() != 1) {
+		printf("removing an object twice gave two objects the same handle\n");
+		return false;
+	}
+	return true;
+}
+
+// Check() goes thru the objects in the order of their handles, so the objects it hits and where it stops have to be
+// the same for every broad phase and quadtree capacity - returns false if some of them gives a different result
+bool CheckResolveOrder()
+{
+	// the broad phases + the quadtree with a few different capacities
+	const int configs[][2] = { { 0, 8 }, { 0, 1 }, { 0, 4 }, { 0, 32 }, { 1, 0 }, { 2, 0 }, { 3, 0 } };
+	std::vector<float> first;
+	bool ok = true;
+	for (const auto& config : configs) {
+		srand(77);
+		cl::World world((cl::BroadPhaseType)config[0]);
+		if (config[1] != 0)
+			world.Tree().SetCapacity(config[1]);
+
+		// lots of overlapping solid and trigger objects, some of them static
+		for (int i = 0; i < 2000; i++) {
+			cl::Rect bounds((float)(rand() % 1000), (float)(rand() % 1000), (float)(4 + rand() % 40), (float)(4 + rand() % 40));
+			cl::CollisionType type = (rand() % 3 == 0) ? cl::CollisionType::Cross : cl::CollisionType::Solid;
+			if (rand() % 4 == 0)
+				world.AddStaticObject(i, bounds, type);
+			else
+				world.AddObject(i, bounds, type);
+		}
+		world.UpdateQuadTree();
+
+		// the position after each Check + the objects it hit (in the order it hit them)
+		std::vector<float> result;
+		for (int i = 0; i < 500; i++) {
+			cl::Rect mover((float)(rand() % 1000), (float)(rand() % 1000), 16, 16);
+			cl::Point goal = { mover.X + (rand() % 81) - 40, mover.Y + (rand() % 81) - 40 };
+			cl::Point end = world.Check(4, mover, goal, [&](cl::Body& b, cl::World*) {
+				result.push_back((float)b.Id);
+			});
+			result.push_back(end.X);
+			result.push_back(end.Y);
+		}
+
+		if (first.empty())
+			first = result;
+		else if (result != first) {
+			if (config[1] != 0)
+				printf("%s (capacity %d): Check gave a different result\n", broadPhaseNames[config[0]], config[1]);
+			else
+				printf("%s: Check gave a different result\n", broadPhaseNames[config[0]]);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// a filter that isnt marked as pure can give a different type for the same ID on every call (a door that opens), so
+// GridWorld mustnt cache it - returns false if a grid world still uses the type it got before the door was opened
+bool CheckStatefulFilter()
+{
+	bool open = false;
+	auto door = [&](int id) { return (id == 0 || (id == 5 && open)) ? cl::CollisionType::None : cl::CollisionType::Solid; };
+
+	cl::GridWorld grid;
+	grid.Create(8, 1, 16, 16);
+	grid.SetObject(4, 0, 5);
+	grid.GetCollisionType = door;
+
+	cl::ChunkedGridWorld chunked;
+	chunked.Create(8, 1, 16, 16);
+	chunked.SetObject(4, 0, 5);
+	chunked.GetCollisionType = door;
+
+	bool ok = true;
+	for (int i = 0; i < 2; i++) {
+		cl::Rect player(32, 0, 16, 16);
+		float gridX = grid.Check(8, player, { 112, 0 }).X;
+		float chunkedX = chunked.Check(8, player, { 112, 0 }).X;
+		float expected = open ? 112.0f : 48.0f;
+		if (gridX != expected || chunkedX != expected) {
+			printf("the door is %s but the player stopped at %.1f/%.1f instead of %.1f\n", open ? "open" : "closed", gridX, chunkedX, expected);
+			ok = false;
+		}
+		open = true;
+	}
+	return ok;
+}
+
+// a server that spawns and despawns entities (each with a few bodies that share its id) every tick - finding and
+// removing the bodies of the despawned entities shouldnt depend on the number of bodies in the world
+void BenchmarkDespawn(int entities)
+{
+	// the world grows with the number of bodies (about one body per 32x32 pixels, like the scenes of the suite)
+	int size = (int)(32 * std::sqrt(entities * 4.0));
+
+	srand(66);
+	cl::World world;
+	auto spawn = [&](int id) {
+		for (int i = 0; i < 4; i++)
+			world.AddObject(id, cl::Rect((float)(rand() % size), (float)(rand() % size), 16, 16), cl::CollisionType::Solid);
+	};
+	for (int id = 0; id < entities; id++)
+		spawn(id);
+
+	// every tick 1000 old entities are despawned and 1000 new ones take their place
+	size_t found = 0;
+	int next = entities;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int tick = 0; tick < 20; tick++) {
+		for (int i = 0; i < 1000; i++) {
+			int id = next - entities + i;
+			found += world.GetObjects(id).size();
+			world.RemoveObjects(id);
+		}
+		for (int i = 0; i < 1000; i++)
+			spawn(next + i);
+		next += 1000;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	printf("%10d %10d %12.2f %12zu\n", entities, entities * 4, std::chrono::duration<double, std::milli>(end - start).count() / 20, found);
+}
+
+// move lots of objects with CheckMany every frame, on its own and with pools of 1, 2, 4 and 8 threads - the speedup
+// is limited by the number of CPU cores, but the results have to be the same for every pool
+void BenchmarkCheckManyThreads(int count)
+{
+	int size = (int)(32 * std::sqrt((double)count));
+
+	srand(55);
+	cl::World world;
+	std::vector<cl::Rect> bodies(count);
+	std::vector<cl::Point> goals(count), results(count);
+	for (int i = 0; i < count; i++) {
+		world.AddObject(i, cl::Rect((float)(rand() % size), (float)(rand() % size), 16, 16), cl::CollisionType::Solid);
+		bodies[i] = cl::Rect((float)(rand() % size), (float)(rand() % size), 16, 16);
+		goals[i] = { bodies[i].X + (float)(rand() % 64 - 32), bodies[i].Y + (float)(rand() % 64 - 32) };
+	}
+
+	// time of a frame (the best of a few) + sum of the results
+	auto run = [&](cl::ThreadPool* pool, double& sum) {
+		double best = 0;
+		for (int frame = 0; frame < 5; frame++) {
+			auto start = std::chrono::high_resolution_clock::now();
+			if (pool != nullptr)
+				world.CheckMany(*pool, 4, bodies.data(), goals.data(), results.data(), count);
+			else
+				world.CheckMany(4, bodies.data(), goals.data(), results.data(), count);
+			auto end = std::chrono::high_resolution_clock::now();
+
+			double time = std::chrono::duration<double, std::milli>(end - start).count();
+			best = (frame == 0) ? time : std::min(best, time);
+		}
+
+		sum = 0;
+		for (const cl::Point& res : results)
+			sum += res.X + res.Y;
+		return best;
+	};
+
+	double sum;
+	double single = run(nullptr, sum);
+	printf("%10d %10s %12.2f %10s %14.0f\n", count, "none", single, "", sum);
+	for (unsigned int threads = 1; threads <= 8; threads *= 2) {
+		cl::ThreadPool pool(threads);
+		double time = run(&pool, sum);
+		printf("%10d %10u %12.2f %9.2fx %14.0f\n", count, threads, time, single / time, sum);
+	}
+}
+
+// time lots of Check(), Sweep() and Raycast() calls on a big tile map (small bodies moving a bit and big bodies moving far)
+template<typename Grid>
+void BenchmarkGrid(const char* name, int tileBytes, int fill)
+{
+	const int size = 4096, tile = 16;
+
+	Grid grid;
+	grid.Create(size, size, tile, tile);
+	srand(42);
+	for (int y = 0; y < size; y++)
+		for (int x = 0; x < size; x++)
+			if (rand() % 100 < fill)
+				grid.SetObject(x, y, 1 + rand() % 200);
+	grid.GetCollisionType = [](int id) {
+		return id == 0 ? cl::CollisionType::None : (id < 50 ? cl::CollisionType::Cross : cl::CollisionType::Solid);
+	};
+	grid.GetCollisionType.SetPure(true);
+
+	const int count = 200000;
+	float sum = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++) {
+		cl::Rect player((float)(rand() % (size * tile)), (float)(rand() % (size * tile)), 24, 24);
+		cl::Point res = grid.Check(2, player, { player.X + (float)(rand() % 64 - 32), player.Y + (float)(rand() % 64 - 32) });
+		sum += res.X + res.Y;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double small = std::chrono::duration<double, std::milli>(end - start).count();
+
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count / 100; i++) {
+		cl::Rect player((float)(rand() % (size * tile)), (float)(rand() % (size * tile)), 256, 256);
+		cl::Point res = grid.Check(8, player, { player.X + (float)(rand() % 4096 - 2048), player.Y + (float)(rand() % 4096 - 2048) });
+		sum += res.X + res.Y;
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double big = std::chrono::duration<double, std::milli>(end - start).count();
+
+	// long diagonal moves (up to 200 tiles) - Sweep() only visits the tiles the body passes thru
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count / 10; i++) {
+		cl::Rect player((float)(rand() % (size * tile)), (float)(rand() % (size * tile)), 24, 24);
+		float dist = (float)(rand() % (200 * tile));
+		cl::Point res = grid.Sweep(player, { player.X + (i % 2 ? dist : -dist), player.Y + (i / 2 % 2 ? dist : -dist) });
+		sum += res.X + res.Y;
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double sweep = std::chrono::duration<double, std::milli>(end - start).count();
+
+	// line of sight checks over the same distance
+	start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count / 10; i++) {
+		cl::Point from = { (float)(rand() % (size * tile)), (float)(rand() % (size * tile)) };
+		cl::Point to = { from.X + (float)(rand() % (400 * tile) - 200 * tile), from.Y + (float)(rand() % (400 * tile) - 200 * tile) };
+		cl::GridRaycastHit hit;
+		if (grid.Raycast(from, to, hit))
+			sum += hit.Fraction;
+	}
+	end = std::chrono::high_resolution_clock::now();
+	double ray = std::chrono::duration<double, std::milli>(end - start).count();
+
+	printf("%12s %6d%% %12.1f %12.1f %12.1f %12.1f %12.1f %14.0f\n", name, fill, size * (double)size * tileBytes / (1 << 20), small, big, sweep, ray, sum);
+}
+
+// walk through a huge generated map that would never fit in memory
+void BenchmarkChunked()
+{
+	const int size = 1 << 20, tile = 16;
+
+	cl::ChunkedGridWorld16 grid;
+	grid.Create(size, size, tile, tile);
+	grid.SetMemoryBudget(16 * 1024 * 1024);
+
+	// most of the world is empty, every eighth chunk has some random walls
+	grid.LoadChunk = [](int chunkX, int chunkY, uint16_t* tiles) -> bool {
+		unsigned int seed = (unsigned int)chunkX * 73856093u ^ (unsigned int)chunkY * 19349663u;
+		if (seed % 8 != 0)
+			return false;
+
+		for (int i = 0; i < cl::ChunkedGridWorld16::ChunkSize * cl::ChunkedGridWorld16::ChunkSize; i++) {
+			seed = seed * 1103515245u + 12345u;
+			tiles[i] = (seed >> 16) % 10 == 0 ? 1 : 0;
+		}
+		return true;
+	};
+
+	cl::Point player = { size * (float)tile / 2, size * (float)tile / 2 };
+	const int count = 200000;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++) {
+		cl::Point goal = { player.X + 200, player.Y + (float)(rand() % 200 - 100) };
+		player = grid.Check(4, cl::Rect(player.X, player.Y, 24, 24), goal);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	printf("\nchunked %dx%d map: %d checks in %.1f ms, moved to (%.0f, %.0f), %.1f MB loaded\n", size, size, count,
+		std::chrono::duration<double, std::milli>(end - start).count(), player.X, player.Y, grid.GetMemoryUsage() / (1024.0 * 1024.0));
+}
+
+// one measurement of the benchmark suite
+struct Result
+{
+	std::string Name;
+	Layout Scene;
+	int Bodies;
+	int Steps;		// 0 if the operation doesnt have steps
+	float Size;		// size of the moving body, 0 if there isnt one
+	int Ops;
+	double NsPerOp;
+	double Checksum;	// depends only on the results, so it can be used to see if two runs did the same work
+};
+std::vector<Result> results;
+
+// time func (which does ops operations and returns a checksum) and store the result
+template<typename F>
+void Record(const char* name, Layout layout, int bodies, int steps, float size, int ops, F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	double checksum = func();
+	auto end = std::chrono::high_resolution_clock::now();
+
+	Result res = { name, layout, bodies, steps, size, ops, std::chrono::duration<double, std::nano>(end - start).count() / ops, checksum };
+	results.push_back(res);
+	printf("%18s %10s %8d %6d %6.0f %8d %14.1f %18.0f\n", name, layoutNames[(int)layout], bodies, steps, size, ops, res.NsPerOp, checksum);
+}
+
+// move bodies of the given size thru the scene in a few steps, each one goes up to 128 pixels far - every call
+// gets the same moves so the checksums can be compared between runs
+template<typename Collide>
+void RecordChecks(const char* name, Layout layout, const Scene& scene, Collide collide)
+{
+	const int sizes[] = { 8, 32, 128 };
+	for (int steps = 1; steps <= 16; steps *= 4) {
+		for (int size : sizes) {
+			Record(name, layout, (int)scene.Bodies.size(), steps, (float)size, 5000, [&]() {
+				Random random(99);
+				double sum = 0;
+				for (int i = 0; i < 5000; i++) {
+					cl::Rect body(random.Float(scene.Size), random.Float(scene.Size), (float)size, (float)size);
+					cl::Point res = collide(steps, body, cl::Point{ body.X + (float)(random.Int(256) - 128), body.Y + (float)(random.Int(256) - 128) });
+					sum += res.X + res.Y;
+				}
+				return sum;
+			});
+		}
+	}
+}
+
+// every layout with 1k to maxCount bodies: rebuilding the quadtree, querying it and moving bodies with
+// World::Check (and GridWorld::Check for tile maps)
+void RunSuite(int maxCount)
+{
+	printf("%18s %10s %8s %6s %6s %8s %14s %18s\n", "benchmark", "layout", "bodies", "steps", "size", "ops", "ns/op", "checksum");
+
+	for (int l = 0; l < 4; l++) {
+		Layout layout = (Layout)l;
+		for (int count = 1000; count <= maxCount; count *= 10) {
+			Scene scene = GenerateScene(layout, count, 1 + l);
+
+			cl::World world;
+			for (int i = 0; i < count; i++)
+				world.AddObject(i, scene.Bodies[i], i % 4 == 0 ? cl::CollisionType::Cross : cl::CollisionType::Solid);
+
+			int rebuilds = std::max(1, 100000 / count);
+			Record("UpdateQuadTree", layout, count, 0, 0, rebuilds, [&]() {
+				for (int i = 0; i < rebuilds; i++)
+					world.UpdateQuadTree();
+				return (double)world.GetObjects().size();
+			});
+
+			std::vector<cl::BodyHandle> found;
+			Record("QuadTree::Query", layout, count, 0, 0, 20000, [&]() {
+				Random random(7);
+				double sum = 0;
+				for (int i = 0; i < 20000; i++) {
+					found.clear();
+					world.Tree().Query(cl::Rect(random.Float(scene.Size), random.Float(scene.Size), 64, 64), found);
+					sum += found.size();
+				}
+				return sum;
+			});
+
+			RecordChecks("World::Check", layout, scene, [&](int steps, cl::Rect body, cl::Point goal) {
+				return world.Check(steps, body, goal);
+			});
+
+			// tile maps also go into a grid with one tile per body
+			if (layout == Layout::TileMap) {
+				int cells = (int)scene.Size / 16;
+				cl::GridWorld grid;
+				grid.Create(cells, cells, 16, 16);
+				for (int i = 0; i < count; i++)
+					grid.SetObject((int)scene.Bodies[i].X / 16, (int)scene.Bodies[i].Y / 16, i % 4 == 0 ? 1 : 2);
+				grid.GetCollisionType = [](int id) {
+					return id == 0 ? cl::CollisionType::None : (id == 1 ? cl::CollisionType::Cross : cl::CollisionType::Solid);
+				};
+				grid.GetCollisionType.SetPure(true);
+
+				RecordChecks("GridWorld::Check", layout, scene, [&](int steps, cl::Rect body, cl::Point goal) {
+					return grid.Check(steps, body, goal);
+				});
+			}
+		}
+	}
+}
+
+// write the suite results as {"results": [...]}
+bool WriteJson(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (file == nullptr)
+		return false;
+
+	fprintf(file, "{\n\t\"results\": [");
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result& res = results[i];
+		fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"layout\": \"%s\", \"bodies\": %d, \"steps\": %d, \"size\": %g, \"ops\": %d, \"ns_per_op\": %.3f, \"checksum\": %.17g }",
+			i == 0 ? "" : ",", res.Name.c_str(), layoutNames[(int)res.Scene], res.Bodies, res.Steps, res.Size, res.Ops, res.NsPerOp, res.Checksum);
+	}
+	fprintf(file, "\n\t]\n}\n");
+
+	return fclose(file) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	// --suite runs only the benchmark suite, --json <file> also writes its results to a file,
+	// --max <count> limits the number of bodies (1000000 by default)
+	bool suite = false;
+	const char* json = nullptr;
+	int maxCount = 1000000;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--suite") == 0)
+			suite = true;
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+			suite = true;
+			json = argv[++i];
+		} else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc)
+			maxCount = atoi(argv[++i]);
+		else {
+			printf("usage: %s [--suite] [--json <file>] [--max <count>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (!CheckInvalidBounds() || !CheckPushedBodies() || !CheckPoppedBodies() || !CheckDoubleRemove() ||
+		!CheckResolveOrder() || !CheckStatefulFilter())
+		return 1;
+
+	if (suite) {
+		RunSuite(maxCount);
+		if (json != nullptr && !WriteJson(json)) {
+			printf("failed to write %s\n", json);
+			return 1;
+		}
+		return 0;
+	}
+
+	srand(1234);
+
+	// fill the world with lots of overlapping quads so that many of them are stored in multiple nodes
+	cl::World world;
+	for (int i = 0; i < 200000; i++) {
+		cl::Rect quad((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), (float)(1 + rand() % QUAD_SIZE), (float)(1 + rand() % QUAD_SIZE));
+		world.AddObject(i, quad, cl::CollisionType::Solid);
+	}
+
+	// query larger and larger regions - time per returned body should stay the same
+	printf("%10s %10s %12s %12s\n", "region", "bodies", "time (us)", "ns/body");
+
+	std::vector<cl::BodyHandle> result;
+	for (int size = 64; size <= WORLD_SIZE; size *= 2) {
+		cl::Rect region((WORLD_SIZE - size) / 2.0f, (WORLD_SIZE - size) / 2.0f, (float)size, (float)size);
+
+		double time = Measure([&]() {
+			result.clear();
+			world.Query(region, result);
+		});
+
+		printf("%10d %10zu %12.1f %12.2f\n", size, result.size(), time, time * 1000.0 / std::max<size_t>(result.size(), 1));
+	}
+
+	// loading a saved world vs building it again
+	auto start = std::chrono::high_resolution_clock::now();
+	world.UpdateQuadTree();
+	auto end = std::chrono::high_resolution_clock::now();
+	double rebuild = std::chrono::duration<double, std::milli>(end - start).count();
+
+	world.Save("benchmark_world.bin");
+	start = std::chrono::high_resolution_clock::now();
+	cl::World loaded;
+	bool ok = loaded.Load("benchmark_world.bin");
+	end = std::chrono::high_resolution_clock::now();
+	std::remove("benchmark_world.bin");
+	printf("\nrebuilding the quadtree: %.1f ms, loading the world from a file: %.1f ms (%s)\n", rebuild,
+		std::chrono::duration<double, std::milli>(end - start).count(), ok ? "ok" : "failed");
+
+	// fast objects - more steps make Check() more precise but slower, Sweep() is precise in one pass
+	printf("\n%16s %12s %12s\n", "method", "time (ms)", "checksum");
+	for (int steps = 1; steps <= 64; steps *= 4) {
+		srand(99);
+		double sum = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < 20000; i++) {
+			cl::Rect player((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 16, 16);
+			cl::Point res = world.Check(steps, player, { player.X + (float)(rand() % 512 - 256), player.Y + (float)(rand() % 512 - 256) });
+			sum += res.X + res.Y;
+		}
+		end = std::chrono::high_resolution_clock::now();
+		printf("%13s %2d %12.1f %12.0f\n", "Check steps", steps, std::chrono::duration<double, std::milli>(end - start).count(), sum);
+	}
+	{
+		srand(99);
+		double sum = 0;
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < 20000; i++) {
+			cl::Rect player((float)(rand() % WORLD_SIZE), (float)(rand() % WORLD_SIZE), 16, 16);
+			cl::Point res = world.Sweep(player, { player.X + (float)(rand() % 512 - 256), player.Y + (float)(rand() % 512 - 256) });
+			sum += res.X + res.Y;
+		}
+		end = std::chrono::high_resolution_clock::now();
+		printf("%16s %12.1f %12.0f\n", "Sweep", std::chrono::duration<double, std::milli>(end - start).count(), sum);
+	}
+
+	// compare the broad phases on different layouts
+	printf("\n%10s %14s %12s %12s %12s %12s %12s %12s %12s\n", "layout", "broad phase", "build (ms)", "move (ms)", "rebuild (ms)", "query (ms)", "found", "ray (ms)", "blocked");
+
+	for (int layout = 0; layout < 3; layout++)
+		CompareBroadPhases(layoutNames[layout], GenerateScene((Layout)layout, 50000, 1).Bodies);
+
+	// static level geometry in its own tree vs everything in one structure
+	printf("\n%16s %14s %12s %12s %14s\n", "objects", "broad phase", "frames (ms)", "rebuild (ms)", "checksum");
+	for (int t = 0; t < 3; t++) {
+		BenchmarkStaticSplit(false, (cl::BroadPhaseType)t);
+		BenchmarkStaticSplit(true, (cl::BroadPhaseType)t);
+	}
+
+	// quadtree vs bulk loaded tree for static objects
+	printf("\n%10s %14s %12s %12s %12s %12s %12s %12s\n", "objects", "index", "build (ms)", "query (ms)", "found", "ray (ms)", "visited", "size (MB)");
+	for (int count = 100000; count <= 1000000; count *= 10) {
+		BenchmarkStaticIndex<cl::QuadTree>("QuadTree", count);
+		BenchmarkStaticIndex<cl::PackedTree>("PackedTree", count);
+	}
+
+	// collision layers
+	printf("\n%14s %14s %12s %12s %12s %14s %14s\n", "broad phase", "filter (ms)", "mask (ms)", "found", "found mask", "check rect", "check body");
+	for (int t = 0; t < 4; t++)
+		BenchmarkLayers((cl::BroadPhaseType)t);
+
+	// despawning entities
+	printf("\n%10s %10s %12s %12s\n", "entities", "bodies", "tick (ms)", "found");
+	for (int entities = 10000; entities <= 100000; entities *= 10)
+		BenchmarkDespawn(entities);
+
+	// CheckMany with more and more threads
+	printf("\n%10s %10s %12s %10s %14s\n", "objects", "threads", "frame (ms)", "speedup", "checksum");
+	for (int count = 10000; count <= 100000; count *= 10)
+		BenchmarkCheckManyThreads(count);
+
+	// tile maps with different tile types
+	printf("\n%12s %7s %12s %12s %12s %12s %12s %14s\n", "grid", "filled", "tiles (MB)", "small (ms)", "big (ms)", "sweep (ms)", "ray (ms)", "checksum");
+	for (int fill = 1; fill <= 25; fill *= 5) {
+		BenchmarkGrid<cl::GridWorld>("GridWorld", 4, fill);
+		BenchmarkGrid<cl::GridWorld16>("GridWorld16", 2, fill);
+		BenchmarkGrid<cl::GridWorld8>("GridWorld8", 1, fill);
+	}
+
+	BenchmarkChunked();
+
+	return 0;
+}